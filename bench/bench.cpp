@@ -0,0 +1,362 @@
+// Microbenchmarks for the hot paths of the C API: parsing, function
+// lookup, walking a signature's types, signature accessors, and batch
+// marshalling.  Run from the top of the tree with `make bench`.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "to-wit.h"
+#include "gen.h"
+
+#define CHECK(r_)                                   \
+    if (!(r_))                                      \
+    {                                               \
+        fprintf(                                    \
+            stderr,                                 \
+            "ERROR: %s (%s, %d)\n",                 \
+                wit_error_get(nullptr),             \
+                __FILE__,                           \
+                __LINE__);                          \
+        exit(1);                                    \
+    }
+
+static std::string readFile(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+    {
+        fprintf(stderr, "ERROR: Can't open %s\n", path);
+        exit(1);
+    }
+    std::string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        text.append(buf, n);
+    fclose(f);
+    return text;
+}
+
+static const std::string& exampleSpec()
+{
+    static const std::string text = readFile("example/example.wit");
+    return text;
+}
+
+static const std::string& bigSpec()
+{
+    GenParams p;
+    p.funcs = 2000;
+    static const std::string text = genSpec(p);
+    return text;
+}
+
+static WIT* parse(const std::string& text)
+{
+    WIT* wit;
+    CHECK(wit_parse(nullptr, (const uint8_t*)text.data(), text.size(), &wit));
+    return wit;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+static void parseBench(benchmark::State& state, const std::string& text)
+{
+    for (auto _ : state)
+    {
+        WIT* wit = parse(text);
+        benchmark::DoNotOptimize(wit);
+        wit_delete(nullptr, wit);
+    }
+    state.SetBytesProcessed(state.iterations() * text.size());
+}
+
+static void BM_ParseExample(benchmark::State& state)
+{
+    parseBench(state, exampleSpec());
+}
+BENCHMARK(BM_ParseExample);
+
+static void BM_ParseLarge(benchmark::State& state)
+{
+    parseBench(state, bigSpec());
+}
+BENCHMARK(BM_ParseLarge)->Unit(benchmark::kMillisecond);
+
+// Parse time and image size as the function count and nesting depth
+// grow.
+static void BM_ParseScale(benchmark::State& state)
+{
+    GenParams p;
+    p.funcs = state.range(0);
+    p.depth = state.range(1);
+    std::string text = genSpec(p);
+    parseBench(state, text);
+
+    WIT* wit = parse(text);
+    size_t len;
+    CHECK(wit_serialize(nullptr, wit, nullptr, 0, &len));
+    state.counters["image_bytes"] = len;
+    state.counters["spec_bytes"] = text.size();
+    wit_delete(nullptr, wit);
+}
+BENCHMARK(BM_ParseScale)
+    ->ArgNames({"funcs", "depth"})
+    ->ArgsProduct({{100, 1000, 10000}, {1, 2, 4}})
+    ->Unit(benchmark::kMillisecond);
+
+static void BM_FuncGetByIndex(benchmark::State& state)
+{
+    WIT* wit = parse(bigSpec());
+    size_t count;
+    CHECK(wit_func_count_get(nullptr, wit, &count));
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        const WITFunction* func;
+        CHECK(wit_func_get_by_index(nullptr, wit, i, &func));
+        benchmark::DoNotOptimize(func);
+        if (++i == count)
+            i = 0;
+    }
+    wit_delete(nullptr, wit);
+}
+BENCHMARK(BM_FuncGetByIndex);
+
+static void BM_FuncGetByName(benchmark::State& state)
+{
+    WIT* wit = parse(bigSpec());
+    size_t count;
+    CHECK(wit_func_count_get(nullptr, wit, &count));
+    std::vector<std::string> names;
+    for (size_t i = 0; i < count; ++i)
+        names.push_back("f" + std::to_string(i));
+    size_t i = 0;
+    for (auto _ : state)
+    {
+        const WITFunction* func;
+        CHECK(wit_func_get_by_name(nullptr, wit, names[i].c_str(), &func));
+        benchmark::DoNotOptimize(func);
+        if (++i == count)
+            i = 0;
+    }
+    wit_delete(nullptr, wit);
+}
+BENCHMARK(BM_FuncGetByName);
+
+// Visits every type reachable from a typedef, as the example's
+// `printType` does, reading each one's name, kind, size, alignment and
+// offset.  Iterators are heap-allocated, or built on the stack if
+// `inPlace`.
+static size_t walkType(const WITTypeDef* td, bool inPlace)
+{
+    const char* name;
+    WITType ty;
+    uintptr_t size, align, offset;
+    CHECK(wit_typedef_name_get(nullptr, td, &name));
+    CHECK(wit_typedef_type_get(nullptr, td, &ty));
+    CHECK(wit_typedef_size_get(nullptr, td, &size));
+    CHECK(wit_typedef_align_get(nullptr, td, &align));
+    CHECK(wit_typedef_offset_get(nullptr, td, &offset));
+    size_t visited = 1;
+
+    switch (ty)
+    {
+        case WITType::Record:
+            {
+                WITIterStorage storage;
+                WITFieldIter* fi;
+                CHECK(inPlace ? wit_record_field_walk_in(nullptr, td, &storage, &fi)
+                              : wit_record_field_walk(nullptr, td, &fi));
+                while (!wit_field_iter_off(nullptr, fi))
+                {
+                    const WITTypeDef* fty;
+                    CHECK(wit_field_iter_at(nullptr, fi, &fty));
+                    visited += walkType(fty, inPlace);
+                    CHECK(wit_field_iter_next(nullptr, fi));
+                }
+                if (!inPlace)
+                    wit_field_iter_delete(nullptr, fi);
+            }
+            break;
+
+        case WITType::Variant:
+            {
+                WITIterStorage storage;
+                WITCaseIter* ci;
+                CHECK(inPlace ? wit_variant_case_walk_in(nullptr, td, &storage, &ci)
+                              : wit_variant_case_walk(nullptr, td, &ci));
+                while (!wit_case_iter_off(nullptr, ci))
+                {
+                    const WITTypeDef* cty;
+                    CHECK(wit_case_iter_at(nullptr, ci, &cty));
+                    visited += walkType(cty, inPlace);
+                    CHECK(wit_case_iter_next(nullptr, ci));
+                }
+                if (!inPlace)
+                    wit_case_iter_delete(nullptr, ci);
+            }
+            break;
+
+        case WITType::Expected:
+            {
+                const WITTypeDef* okTy;
+                const WITTypeDef* errTy;
+                CHECK(wit_expected_ok_typedef_get(nullptr, td, &okTy));
+                CHECK(wit_expected_err_typedef_get(nullptr, td, &errTy));
+                visited += walkType(okTy, inPlace);
+                visited += walkType(errTy, inPlace);
+            }
+            break;
+
+        case WITType::List:
+            {
+                const WITTypeDef* elem;
+                CHECK(wit_list_elem_typedef_get(nullptr, td, &elem));
+                visited += walkType(elem, inPlace);
+            }
+            break;
+
+        case WITType::Type:
+            {
+                const WITTypeDef* aliased;
+                CHECK(wit_type_aliased_typedef_get(nullptr, td, &aliased));
+                visited += walkType(aliased, inPlace);
+            }
+            break;
+
+        default:
+            break;
+    }
+    return visited;
+}
+
+static size_t walkFunc(const WITFunction* func, bool inPlace)
+{
+    WITIterStorage storage;
+    WITTypeDefIter* it;
+    CHECK(inPlace ? wit_func_param_walk_in(nullptr, func, &storage, &it)
+                  : wit_func_param_walk(nullptr, func, &it));
+    size_t visited = 0;
+    while (!wit_typedef_iter_off(nullptr, it))
+    {
+        const WITTypeDef* td;
+        CHECK(wit_typedef_iter_at(nullptr, it, &td));
+        visited += walkType(td, inPlace);
+        CHECK(wit_typedef_iter_next(nullptr, it));
+    }
+    if (!inPlace)
+        wit_typedef_iter_delete(nullptr, it);
+
+    const WITTypeDef* result;
+    CHECK(wit_func_result_get(nullptr, func, &result));
+    return visited + walkType(result, inPlace);
+}
+
+static void walkBench(benchmark::State& state, bool inPlace)
+{
+    WIT* wit = parse(bigSpec());
+    size_t count;
+    CHECK(wit_func_count_get(nullptr, wit, &count));
+    size_t visited = 0;
+    for (auto _ : state)
+    {
+        for (size_t i = 0; i < count; ++i)
+        {
+            const WITFunction* func;
+            CHECK(wit_func_get_by_index(nullptr, wit, i, &func));
+            visited += walkFunc(func, inPlace);
+        }
+    }
+    state.SetItemsProcessed(visited);
+    wit_delete(nullptr, wit);
+}
+
+static void BM_WalkAll(benchmark::State& state)
+{
+    walkBench(state, false);
+}
+BENCHMARK(BM_WalkAll)->Unit(benchmark::kMillisecond);
+
+static void BM_WalkAllInPlace(benchmark::State& state)
+{
+    walkBench(state, true);
+}
+BENCHMARK(BM_WalkAllInPlace)->Unit(benchmark::kMillisecond);
+
+static void BM_SigAccessors(benchmark::State& state)
+{
+    WIT* wit = parse(exampleSpec());
+    const WITFunction* func;
+    CHECK(wit_func_get_by_name(nullptr, wit, "sentiment", &func));
+    for (auto _ : state)
+    {
+        const WITSignature* sig;
+        CHECK(wit_func_sig_get(nullptr, func, &sig));
+        bool indirect;
+        CHECK(wit_sig_is_indirect(nullptr, sig, WITSigPart::Results, &indirect));
+        size_t len;
+        CHECK(wit_sig_length_get(nullptr, sig, WITSigPart::Params, &len));
+        for (size_t i = 0; i < len; ++i)
+        {
+            WASMType ty;
+            CHECK(wit_sig_type_get_by_index(nullptr, sig, WITSigPart::Params, i, &ty));
+            benchmark::DoNotOptimize(ty);
+        }
+        const WASMType* types;
+        CHECK(wit_sig_types_get(nullptr, sig, WITSigPart::Results, &types, &len));
+        benchmark::DoNotOptimize(types);
+    }
+    wit_delete(nullptr, wit);
+}
+BENCHMARK(BM_SigAccessors);
+
+// Lowers a column of `rows` strings of 16 bytes each.
+static void BM_ListLowerBatch(benchmark::State& state)
+{
+    WIT* wit = parse(exampleSpec());
+    const WITFunction* func;
+    CHECK(wit_func_get_by_name(nullptr, wit, "hilbert-encode", &func));
+    const WITTypeDef* str;
+    CHECK(wit_func_result_get(nullptr, func, &str));
+
+    size_t rows = state.range(0);
+    std::vector<uint8_t> values(rows * 16, 'x');
+    std::vector<uint32_t> offsets(rows + 1);
+    for (size_t i = 0; i <= rows; ++i)
+        offsets[i] = i * 16;
+    std::vector<uint8_t> mem(values.size());
+    std::vector<uint32_t> pairs(rows * 2);
+    for (auto _ : state)
+    {
+        CHECK(wit_list_lower_batch(nullptr, str, values.data(), offsets.data(), rows,
+            mem.data(), mem.size(), 0, pairs.data()));
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * values.size());
+    wit_delete(nullptr, wit);
+}
+BENCHMARK(BM_ListLowerBatch)->Arg(1 << 10)->Arg(1 << 16);
+
+static void BM_Utf8ToChars(benchmark::State& state)
+{
+    std::string text;
+    while (text.size() < (size_t)state.range(0))
+        text += "The quick brown fox jumps over the lazy dog. ";
+    std::vector<uint32_t> chars(text.size());
+    for (auto _ : state)
+    {
+        size_t count;
+        CHECK(wit_utf8_to_chars(nullptr, (const uint8_t*)text.data(), text.size(),
+            chars.data(), chars.size(), &count));
+        benchmark::DoNotOptimize(count);
+    }
+    state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_Utf8ToChars)->Arg(1 << 10)->Arg(1 << 20);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,42 @@
+// Prints a synthetic WIT spec (see `gen.h`) for scale testing, e.g.
+//
+//     target/to-wit-gen -n 5000 -d 6 -w 8 > big.wit
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gen.h"
+
+void usage(const char *progName)
+{
+    fprintf(stderr, "Usage: %s [-n FUNCS] [-d DEPTH] [-w WIDTH] [-a ALIASES]\n\n", progName);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    GenParams p;
+    for (int i = 1; i < argc; i += 2)
+    {
+        if (i + 1 >= argc)
+            usage(argv[0]);
+        int val = atoi(argv[i + 1]);
+        if (val < 0)
+            usage(argv[0]);
+
+        if (strcmp(argv[i], "-n") == 0)
+            p.funcs = val;
+        else if (strcmp(argv[i], "-d") == 0)
+            p.depth = val;
+        else if (strcmp(argv[i], "-w") == 0 && val > 0)
+            p.width = val;
+        else if (strcmp(argv[i], "-a") == 0)
+            p.aliases = val;
+        else
+            usage(argv[0]);
+    }
+
+    std::string spec = genSpec(p);
+    fwrite(spec.data(), 1, spec.size(), stdout);
+    return 0;
+}
@@ -0,0 +1,72 @@
+// Synthetic WIT specs for scale testing, shared by the benchmarks and the
+// `to-wit-gen` tool.
+//
+// A spec is built from levels of shared types.  Level 0 is a record of
+// `width` primitive fields.  Each level above it has a record whose
+// `width` fields refer to the level below (directly, in a list, in an
+// option, or through that level's variant), and a variant with `width`
+// cases each carrying the level below.  A chain of `aliases` type aliases
+// ends at the top record.  Each of the `funcs` functions then takes a
+// record of its own, holding the top level, its variant and the end of the
+// alias chain, and returns an `expected` of the top variant.
+
+#pragma once
+
+#include <string>
+
+struct GenParams
+{
+    int funcs   = 1000;
+    int depth   = 3;
+    int width   = 4;
+    int aliases = 2;
+};
+
+inline std::string genSpec(const GenParams& p)
+{
+    static const char* prims[] = {
+        "u8", "u16", "u32", "u64", "s32", "s64", "float32", "float64", "bool", "char", "string",
+    };
+    std::string spec;
+    auto field = [](int i) { return "f" + std::to_string(i); };
+
+    spec += "record node0 {";
+    for (int i = 0; i < p.width; ++i)
+        spec += std::string(i ? ", " : " ") + field(i) + ": " + prims[i % (sizeof(prims) / sizeof(*prims))];
+    spec += " }\n";
+    spec += "variant choice0 { leaf(node0) }\n";
+
+    for (int d = 1; d <= p.depth; ++d)
+    {
+        std::string below = "node" + std::to_string(d - 1);
+        std::string uses[] = {
+            below, "list<" + below + ">", "option<" + below + ">", "choice" + std::to_string(d - 1),
+        };
+        spec += "record node" + std::to_string(d) + " {";
+        for (int i = 0; i < p.width; ++i)
+            spec += std::string(i ? ", " : " ") + field(i) + ": " + uses[i % 4];
+        spec += " }\n";
+        spec += "variant choice" + std::to_string(d) + " {";
+        for (int i = 0; i < p.width; ++i)
+            spec += std::string(i ? ", " : " ") + "c" + std::to_string(i) + "(" + below + ")";
+        spec += " }\n";
+    }
+
+    std::string top = "node" + std::to_string(p.depth);
+    std::string choice = "choice" + std::to_string(p.depth);
+    std::string alias = top;
+    for (int a = 0; a < p.aliases; ++a)
+    {
+        std::string name = "alias" + std::to_string(a);
+        spec += "type " + name + " = " + alias + "\n";
+        alias = name;
+    }
+
+    for (int i = 0; i < p.funcs; ++i)
+    {
+        std::string n = std::to_string(i);
+        spec += "record args" + n + " { id: u64, top: " + top + ", pick: " + choice + ", via: " + alias + " }\n";
+        spec += "f" + n + ": func(a: args" + n + ", n: s32) -> expected<" + choice + ", string>\n";
+    }
+    return spec;
+}
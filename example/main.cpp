@@ -2,6 +2,9 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <assert.h>
+#include <string.h>
+#include <string>
+#include <vector>
 #include "to-wit.h"
 
 const char *wasmType2Str(WASMType wt)
@@ -98,8 +101,11 @@ void printType(WITSession* s, const WITTypeDef* td, int indent)
     uintptr_t size;
     CHECK(wit_typedef_size_get(s, td, &size));
 
-    printf("[name=%s, type=%s, size=%d, align=%d", 
-        name, witType2Str(ty), size, align);
+    uintptr_t offset;
+    CHECK(wit_typedef_offset_get(s, td, &offset));
+
+    printf("[name=%s, type=%s, size=%" PRIuPTR ", align=%" PRIuPTR ", offset=%" PRIuPTR, 
+        name, witType2Str(ty), size, align, offset);
     switch (ty)
     {
         case WITType::Variant:
@@ -193,18 +199,16 @@ void printSigPart(WITSession* s, const WITSignature* sig, WITSigPart part, bool
     printIndent(1);
     printf("%s (%s): [", wasmSigPart2Str(part), directKind);
 
+    const WASMType* types;
     size_t len;
-    CHECK(wit_sig_length_get(s, sig, part, &len));
+    CHECK(wit_sig_types_get(s, sig, part, &types, &len));
 
     for (int i = 0; i < len; ++i)
     {
         if (i > 0)
             printf(", ");
 
-        WASMType ty;
-        CHECK(wit_sig_type_get_by_index(s, sig, part, i, &ty));
-
-        printf("%s", wasmType2Str(ty));
+        printf("%s", wasmType2Str(types[i]));
     }
     printf("]\n");
 }
@@ -227,8 +231,10 @@ void printSig(WITSession* s, const WITFunction* func)
 void printFunc(WITSession* s, const WITFunction* func)
 {
     printf("Params:\n");
+    // The iterator lives on the stack, so there's nothing to delete.
+    WITIterStorage storage;
     WITTypeDefIter* tdIter;
-    CHECK(wit_func_param_walk(s, func, &tdIter));
+    CHECK(wit_func_param_walk_in(s, func, &storage, &tdIter));
     while (!wit_typedef_iter_off(s, tdIter))
     {
         const WITTypeDef* td;
@@ -238,7 +244,6 @@ void printFunc(WITSession* s, const WITFunction* func)
 
         CHECK(wit_typedef_iter_next(s, tdIter));
     }
-    wit_typedef_iter_delete(s, tdIter);
 
     printf("Result:\n");
     const WITTypeDef* resTd;
@@ -246,47 +251,108 @@ void printFunc(WITSession* s, const WITFunction* func)
     printType(s, resTd, 1);
 }
 
-char *readWIT(const char *path, long *len)
+// Prints the C++ header generated for a spec.
+int printCpp(int argc, char *argv[])
 {
-    FILE* f = fopen(path, "r");
+    WITSession* s = wit_session_new();
+    WIT* wit;
+    CHECK(wit_parse_file(s, argv[0], &wit));
+
+    const char* ns = argc > 1 ? argv[1] : NULL;
+    size_t len;
+    CHECK(wit_codegen_cpp(s, wit, ns, NULL, 0, &len));
+    std::vector<uint8_t> header(len);
+    CHECK(wit_codegen_cpp(s, wit, ns, header.data(), header.size(), &len));
+    fwrite(header.data(), 1, len, stdout);
+
+    wit_delete(s, wit);
+    wit_session_delete(s);
+    return 0;
+}
+
+// Reads a whole file, exiting if it can't.
+std::string readFile(const char* path)
+{
+    FILE* f = fopen(path, "rb");
     if (!f)
     {
-        perror("Error opening file: ");
+        fprintf(stderr, "ERROR: Can't open %s\n", path);
         exit(1);
     }
+    std::string text;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        text.append(buf, n);
+    fclose(f);
+    return text;
+}
 
-    fseek(f, 0, SEEK_END);
-    long sz = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    char *res = (char *) malloc(sz + 1);
-    if (!res)
+// Parses each file as an interface named after it (`dir/foo.wit` is
+// `foo`), and prints the C++ header generated for the first.  Types the
+// interfaces share are stored once.
+int printCppMulti(int argc, char *argv[])
+{
+    WITSession* s = wit_session_new();
+    const char* ns = argv[0];
+    std::vector<std::string> names, texts;
+    for (int i = 1; i < argc; ++i)
     {
-        fprintf(stderr, "Out of memory!\n");
-        exit(1);
+        std::string name = argv[i];
+        name = name.substr(name.find_last_of('/') + 1);
+        names.push_back(name.substr(0, name.find('.')));
+        texts.push_back(readFile(argv[i]));
     }
-    fread(res, 1, sz, f);
-    res[sz] = 0;
+    std::vector<const char*> namePtrs;
+    std::vector<const uint8_t*> contents;
+    std::vector<size_t> lens;
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        namePtrs.push_back(names[i].c_str());
+        contents.push_back((const uint8_t*)texts[i].data());
+        lens.push_back(texts[i].size());
+    }
+    WIT* wit;
+    CHECK(wit_parse_interfaces(s, namePtrs.data(), contents.data(), lens.data(), names.size(), &wit));
 
-    fclose(f);
-    
-    *len = sz;
-    return res;
+    size_t len;
+    CHECK(wit_codegen_cpp(s, wit, ns, NULL, 0, &len));
+    std::vector<uint8_t> header(len);
+    CHECK(wit_codegen_cpp(s, wit, ns, header.data(), header.size(), &len));
+    fwrite(header.data(), 1, len, stdout);
+
+    wit_delete(s, wit);
+    wit_session_delete(s);
+    return 0;
 }
 
 void usage(const char *progName)
 {
-    fprintf(stderr, "Usage: %s PATH [FUNCNAME]\n\n", progName);
+    fprintf(stderr, "Usage: %s PATH [FUNCNAME]\n", progName);
+    fprintf(stderr, "       %s --cpp PATH [NAMESPACE]\n", progName);
+    fprintf(stderr, "       %s --cpp-multi NAMESPACE PATH...\n\n", progName);
     exit(1);
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2 || argc > 3)
+    if (argc > 2 && strcmp(argv[1], "--cpp-multi") == 0)
+    {
+        if (argc < 4)
+            usage(argv[0]);
+        return printCppMulti(argc - 2, argv + 2);
+    }
+    if (argc < 2 || argc > 4)
+        usage(argv[0]);
+    if (strcmp(argv[1], "--cpp") == 0)
+    {
+        if (argc < 3)
+            usage(argv[0]);
+        return printCpp(argc - 2, argv + 2);
+    }
+    if (argc > 3)
         usage(argv[0]);
 
-    long contentLen;
-    char* content = readWIT(argv[1], &contentLen);
     WITSession* s = wit_session_new();
     if (!s)
     {
@@ -295,8 +361,7 @@ int main(int argc, char *argv[])
     }
 
     WIT* wit;
-    CHECK(wit_parse(s, reinterpret_cast<uint8_t*>(content), contentLen, &wit));
-    free(content);
+    CHECK(wit_parse_file(s, argv[1], &wit));
 
     if (argc == 2)
     {
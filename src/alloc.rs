@@ -0,0 +1,134 @@
+// Caller-provided allocator hooks.
+//
+// A session made by `wit_session_new_with_allocator` allocates whatever it
+// hands back through its hooks: the session itself, parsed and loaded
+// WITs and their images, iterators, layouts, diffs' handles and error
+// messages.  Every block records where it came from, so it goes back to
+// the same place whichever session (if any) it is later deleted with.
+// Sessions without hooks use the Rust heap, as before.
+
+use libc::c_void;
+use std::alloc::{self, Layout};
+use std::mem::{align_of, size_of};
+use std::ptr;
+
+use crate::WITSession;
+use crate::error::Result;
+
+// Returns `size` bytes aligned to at least 8, as `malloc` does, or NULL.
+pub type WITAllocFn = Option<extern "C" fn(size: usize, ctx: *mut c_void) -> *mut c_void>;
+pub type WITFreeFn = Option<extern "C" fn(ptr: *mut c_void, ctx: *mut c_void)>;
+
+// Blocks are at least this aligned, however they are allocated.
+const ALIGN: usize = 8;
+
+#[derive(Clone, Copy)]
+pub(crate) struct Allocator {
+    alloc: extern "C" fn(usize, *mut c_void) -> *mut c_void,
+    free:  extern "C" fn(*mut c_void, *mut c_void),
+    ctx:   *mut c_void,
+}
+// The hooks are called from whichever thread does the work, including
+// `wit_parse_many`'s workers, so they must be thread-safe.
+unsafe impl Send for Allocator {}
+unsafe impl Sync for Allocator {}
+impl Allocator {
+    pub(crate) fn new(alloc: WITAllocFn, free: WITFreeFn, ctx: *mut c_void) -> Option<Allocator> {
+        Some(Allocator { alloc: alloc?, free: free?, ctx })
+    }
+}
+
+pub(crate) fn hooks_of(s: *const WITSession) -> Option<Allocator> {
+    if s.is_null() {
+        None
+    } else {
+        unsafe { (*s).alloc }
+    }
+}
+
+// Zeroed memory from a session's hooks, or from the Rust heap if it has
+// none.
+pub(crate) struct Block {
+    ptr:  *mut u8,
+    size: usize,
+    from: Option<Allocator>,
+}
+impl Block {
+    pub(crate) fn new(from: Option<Allocator>, size: usize) -> Result<Block> {
+        let ptr = match from {
+            Some(a) => {
+                let ptr = (a.alloc)(size.max(1), a.ctx) as *mut u8;
+                if ptr.is_null() {
+                    return Err(wit_err!(OutOfMemory, "Allocator returned NULL"));
+                }
+                if ptr as usize % ALIGN != 0 {
+                    (a.free)(ptr as *mut c_void, a.ctx);
+                    return Err(wit_err!(OutOfMemory, "Allocator returned misaligned memory"));
+                }
+                unsafe {
+                    ptr::write_bytes(ptr, 0, size);
+                }
+                ptr
+            },
+            None => {
+                let layout = Self::layout(size);
+                let ptr = unsafe { alloc::alloc_zeroed(layout) };
+                if ptr.is_null() {
+                    alloc::handle_alloc_error(layout);
+                }
+                ptr
+            },
+        };
+        Ok(Block { ptr, size, from })
+    }
+
+    fn layout(size: usize) -> Layout {
+        Layout::from_size_align(size.max(1), ALIGN).unwrap()
+    }
+
+    pub(crate) fn as_ptr(&self) -> *mut u8 {
+        self.ptr
+    }
+
+    #[cfg(feature="stats")]
+    pub(crate) fn size(&self) -> usize {
+        self.size
+    }
+}
+impl Drop for Block {
+    fn drop(&mut self) {
+        match self.from {
+            Some(a) => (a.free)(self.ptr as *mut c_void, a.ctx),
+            None => unsafe { alloc::dealloc(self.ptr, Self::layout(self.size)) },
+        }
+    }
+}
+
+// Handles handed to C are allocated like `Box`es, but with the block they
+// live in stored just in front of them.
+fn head_size<T>() -> usize {
+    assert!(align_of::<T>() <= ALIGN);
+    (size_of::<Block>() + ALIGN - 1) & !(ALIGN - 1)
+}
+
+// Moves `val` into a block of its own, returning a pointer to it that
+// `delete_handle` frees.
+pub(crate) fn new_handle<T>(from: Option<Allocator>, val: T) -> Result<*mut T> {
+    let head = head_size::<T>();
+    let block = Block::new(from, head + size_of::<T>())?;
+    unsafe {
+        let start = block.as_ptr();
+        let res = start.add(head) as *mut T;
+        ptr::write(res, val);
+        ptr::write(start as *mut Block, block);
+        Ok(res)
+    }
+}
+
+// Safety: `handle` must be from `new_handle`, and not yet deleted.
+pub(crate) unsafe fn delete_handle<T>(handle: *mut T) {
+    let start = (handle as *mut u8).sub(head_size::<T>());
+    let block = ptr::read(start as *const Block);
+    ptr::drop_in_place(handle);
+    drop(block);
+}
@@ -0,0 +1,220 @@
+// Background parsing, for callers on an event loop that can't block on a
+// big spec.
+//
+// `wit_parse_async` copies the spec and queues it for a small pool of
+// worker threads, started on first use with one per CPU.  The callback
+// is called exactly once, on a worker, with the parsed `WIT` or an error,
+// so it must be thread-safe and shouldn't block for long.  A `WITCancel`
+// token lets the caller give up on a parse it no longer wants: one that
+// hasn't started is skipped, and one that has is thrown away when it
+// finishes, as parsing itself can't be interrupted.  Either way the
+// callback reports `Cancelled`.
+//
+// The session is only read for its allocator hooks, when the parse is
+// queued.  Errors go to the callback rather than to the session, and
+// the parse isn't counted in the session's statistics.
+
+use libc::{c_char, c_void};
+use std::collections::VecDeque;
+use std::ffi::CString;
+use std::ptr;
+use std::slice;
+use std::sync::{Arc, Condvar, Mutex, OnceLock};
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::thread;
+
+use crate::{WIT, WITSession, utf8};
+use crate::alloc::{Allocator, delete_handle, hooks_of, new_handle};
+use crate::error::{Result, WITErr, WITErrorCode, check};
+#[cfg(feature="catch_panics")]
+use crate::error::error_set;
+use std::panic::{catch_unwind, AssertUnwindSafe};
+
+// Called with the parsed spec and `WITErrorCode::None`, or with NULL, the
+// error's code and its message, which is only valid during the call.  The
+// `WIT` is the callback's to delete.
+pub type WITParseCallback = Option<extern "C" fn(wit: *mut WIT, code: WITErrorCode, msg: *const c_char, user_data: *mut c_void)>;
+
+pub struct WITCancel {
+    cancelled: Arc<AtomicBool>,     // Shared with the parses it was given to
+}
+
+type Job = Box<dyn FnOnce() + Send>;
+
+struct Pool {
+    queue:   Mutex<VecDeque<Job>>,
+    ready:   Condvar,
+    size:    usize,                 // Workers wanted
+    workers: Mutex<usize>,          // Workers started so far
+}
+impl Pool {
+    // Returns the pool once it has at least one worker.  Workers that
+    // couldn't be started are tried again on the next call, so a pool
+    // short of threads recovers when they become available.
+    fn get() -> Result<&'static Pool> {
+        static POOL: OnceLock<Pool> = OnceLock::new();
+        let pool = POOL.get_or_init(|| Pool {
+            queue:   Mutex::new(VecDeque::new()),
+            ready:   Condvar::new(),
+            size:    thread::available_parallelism().map(|n| n.get()).unwrap_or(1),
+            workers: Mutex::new(0),
+        });
+        pool.start()?;
+        Ok(pool)
+    }
+
+    fn start(&'static self) -> Result<()> {
+        let mut workers = self.workers.lock().unwrap_or_else(|e| e.into_inner());
+        while *workers < self.size {
+            let spawned = thread::Builder::new()
+                .name("to-wit-parse".into())
+                .spawn(move || self.work());
+            match spawned {
+                Ok(_) => *workers += 1,
+                Err(e) if *workers == 0 => {
+                    return Err(WITErr::wrap(WITErrorCode::Internal, anyhow::anyhow!("Could not start parse worker: {}", e)));
+                },
+                // The workers there are will get through the queue.
+                Err(_) => break,
+            }
+        }
+        Ok(())
+    }
+
+    fn push(&self, job: Job) {
+        self.queue.lock().unwrap_or_else(|e| e.into_inner()).push_back(job);
+        self.ready.notify_one();
+    }
+
+    fn work(&self) {
+        loop {
+            let job = {
+                let mut queue = self.queue.lock().unwrap_or_else(|e| e.into_inner());
+                loop {
+                    match queue.pop_front() {
+                        Some(job) => break job,
+                        None => queue = self.ready.wait(queue).unwrap_or_else(|e| e.into_inner()),
+                    }
+                }
+            };
+            job();
+            // Nothing to credit a background parse's counts to.
+            let _ = stat_take!();
+        }
+    }
+}
+
+// Everything a queued parse needs.  The caller vouches for `user_data`
+// and the hooks being usable from any thread.
+struct Request {
+    content:   Vec<u8>,
+    alloc:     Option<Allocator>,
+    cancelled: Option<Arc<AtomicBool>>,
+    callback:  extern "C" fn(*mut WIT, WITErrorCode, *const c_char, *mut c_void),
+    user_data: *mut c_void,
+}
+unsafe impl Send for Request {}
+impl Request {
+    fn cancelled(&self) -> bool {
+        self.cancelled.as_ref().map_or(false, |c| c.load(Ordering::Acquire))
+    }
+
+    fn parse(&self) -> Result<*mut WIT> {
+        if self.cancelled() {
+            return Err(wit_err!(Cancelled, "Parse cancelled"));
+        }
+        let wit = WIT::new(utf8(&self.content)?, self.alloc)?;
+        if self.cancelled() {
+            return Err(wit_err!(Cancelled, "Parse cancelled"));
+        }
+        new_handle(self.alloc, wit)
+    }
+
+    // Panics are caught whatever the features, as one that got out would
+    // take the worker with it and leave the callback uncalled.
+    fn run(self) {
+        let res = catch_unwind(AssertUnwindSafe(|| self.parse()))
+            .unwrap_or_else(|e| Err(WITErr::wrap(WITErrorCode::Panic, anyhow::anyhow!("Caught Rust panic: {:?}", e))));
+        match res {
+            Ok(wit) => (self.callback)(wit, WITErrorCode::None, ptr::null(), self.user_data),
+            Err(err) => {
+                let msg = CString::new(err.to_string()).unwrap_or_default();
+                (self.callback)(ptr::null_mut(), err.code(), msg.as_ptr(), self.user_data)
+            },
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Queues `content` to be parsed in the background, as `wit_parse` would,
+// and returns without waiting.  `content` is copied, so it needn't
+// outlive the call.  `cancel` may be NULL.  Fails, without calling
+// `callback`, only if the arguments are unusable or no worker thread
+// could be started.
+#[no_mangle]
+pub extern "C" fn wit_parse_async(s: *mut WITSession, content: *const u8, len: usize, cancel: *const WITCancel, callback: WITParseCallback, user_data: *mut c_void) -> bool {
+    ffi_return!(s, _wit_parse_async(hooks_of(s), content, len, cancel, callback, user_data))
+}
+fn _wit_parse_async(alloc: Option<Allocator>, content: *const u8, len: usize, cancel: *const WITCancel, callback: WITParseCallback, user_data: *mut c_void) -> Result<()> {
+    let callback = match callback {
+        Some(cb) if !content.is_null() || len == 0 => cb,
+        _ => return Err(wit_err!(InvalidArgument, "Invalid arguments")),
+    };
+    let content = if len == 0 {
+        Vec::new()
+    } else {
+        unsafe { slice::from_raw_parts(content, len) }.to_vec()
+    };
+    let cancelled = if cancel.is_null() {
+        None
+    } else {
+        Some(unsafe { &*cancel }.cancelled.clone())
+    };
+    let req = Request { content, alloc, cancelled, callback, user_data };
+    Pool::get()?.push(Box::new(move || req.run()));
+    Ok(())
+}
+
+// Makes a cancellation token, which can be passed to any number of
+// `wit_parse_async` calls.
+#[no_mangle]
+pub extern "C" fn wit_cancel_new(s: *mut WITSession, res: *mut *mut WITCancel) -> bool {
+    ffi_return!(s, _wit_cancel_new(hooks_of(s), res))
+}
+fn _wit_cancel_new(alloc: Option<Allocator>, res: *mut *mut WITCancel) -> Result<()> {
+    if res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let safe_res = new_handle(alloc, WITCancel { cancelled: Arc::new(AtomicBool::new(false)) })?;
+    unsafe {
+        *res = safe_res;
+    }
+    Ok(())
+}
+
+// Cancels every parse the token was given to.  Safe to call from any
+// thread, including while those parses run.
+#[no_mangle]
+pub extern "C" fn wit_cancel_set(s: *mut WITSession, cancel: *const WITCancel) -> bool {
+    ffi_return!(s, _wit_cancel_set(cancel))
+}
+fn _wit_cancel_set(cancel: *const WITCancel) -> Result<()> {
+    if cancel.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    unsafe { &*cancel }.cancelled.store(true, Ordering::Release);
+    Ok(())
+}
+
+// Parses don't hold on to the token itself, so it can be deleted as soon
+// as it's no longer needed for `wit_cancel_set`.
+#[no_mangle]
+pub extern "C" fn wit_cancel_delete(_s: *mut WITSession, cancel: *mut WITCancel) {
+    if cancel.is_null() {
+        return;
+    }
+    unsafe {
+        delete_handle(cancel);
+    }
+}
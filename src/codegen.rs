@@ -0,0 +1,498 @@
+// C++ code generation: a header with one struct per type of a spec, laid
+// out exactly as the canonical ABI lays that type out in linear memory, so
+// a host can copy values in and out with a fixed-size `memcpy` instead of
+// walking typedefs at run time.  Every size, alignment and offset is
+// checked with a `static_assert`, so a header that no longer matches the
+// layout it was generated from won't compile.
+//
+// Strings and lists stay (offset, length) pairs into linear memory; only
+// the fixed-size part of a value is copied.
+
+use libc::c_char;
+use std::ffi::CStr;
+use std::fmt::Write;
+use std::ptr;
+
+use crate::{ImageRef, TypeRec, WIT, WITAbiVariant, WITSession, WITType, WASMType};
+use crate::error::{Result, check};
+#[cfg(feature="catch_panics")]
+use crate::error::{WITErr, WITErrorCode, error_set};
+#[cfg(feature="catch_panics")]
+use std::panic::{catch_unwind, AssertUnwindSafe};
+
+const PREAMBLE: &str = "\
+// Generated by to-wit.  Do not edit.
+//
+// Types are laid out as the canonical ABI lays them out in linear memory
+// (little-endian hosts only).  Strings and lists are (offset, length) pairs
+// into that memory.  Requires C++17.
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#ifndef TO_WIT_CPP_COMMON
+#define TO_WIT_CPP_COMMON
+namespace to_wit {
+
+enum class core_type : uint8_t { I32, I64, F32, F64 };
+
+struct string {
+    uint32_t ptr;
+    uint32_t len;
+};
+
+template <typename T>
+struct list {
+    uint32_t ptr;
+    uint32_t len;
+};
+
+// Copies a value out of linear memory at `ptr`.
+template <typename T>
+inline T lift(const uint8_t* mem, uint32_t ptr) {
+    T val;
+    std::memcpy(&val, mem + ptr, sizeof(T));
+    return val;
+}
+
+// Copies a value into linear memory at `ptr`.
+template <typename T>
+inline void lower(uint8_t* mem, uint32_t ptr, const T& val) {
+    std::memcpy(mem + ptr, &val, sizeof(T));
+}
+
+}  // namespace to_wit
+#endif
+";
+
+// C++20 keywords and alternative tokens.
+const KEYWORDS: &[&str] = &[
+    "alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor",
+    "bool", "break", "case", "catch", "char", "char8_t", "char16_t",
+    "char32_t", "class", "co_await", "co_return", "co_yield", "compl",
+    "concept", "const", "const_cast", "consteval", "constexpr", "constinit",
+    "continue", "decltype", "default", "delete", "do", "double",
+    "dynamic_cast", "else", "enum", "explicit", "export", "extern", "false",
+    "float", "for", "friend", "goto", "if", "inline", "int", "long",
+    "mutable", "namespace", "new", "noexcept", "not", "not_eq", "nullptr",
+    "operator", "or", "or_eq", "private", "protected", "public", "register",
+    "reinterpret_cast", "requires", "return", "short", "signed", "sizeof",
+    "static", "static_assert", "static_cast", "struct", "switch", "template",
+    "this", "thread_local", "throw", "true", "try", "typedef", "typeid",
+    "typename", "union", "unsigned", "using", "virtual", "void", "volatile",
+    "wchar_t", "while", "xor", "xor_eq",
+];
+
+// Names the generated code itself refers to unqualified, which a type or
+// member of the same name would hide.
+const RESERVED: &[&str] = &[
+    "cases", "int8_t", "int16_t", "int32_t", "int64_t", "lift", "lower",
+    "offsetof", "std", "to_wit", "uint8_t", "uint16_t", "uint32_t",
+    "uint64_t",
+];
+
+// A WIT name as a C++ identifier: kebab-case becomes snake_case, and
+// keywords and reserved names get a trailing underscore.
+fn ident(name: &[u8]) -> String {
+    let mut id: String = name.iter()
+        .map(|b| if b.is_ascii_alphanumeric() { *b as char } else { '_' })
+        .collect();
+    if id.is_empty() || id.as_bytes()[0].is_ascii_digit() {
+        id.insert(0, '_');
+    }
+    if KEYWORDS.contains(&id.as_str()) || RESERVED.contains(&id.as_str()) {
+        id.push('_');
+    }
+    id
+}
+
+// A member's name, escaped further while it clashes with one of `taken`:
+// the enclosing type's own name, which only a data member may share, and
+// the names of members the generated code adds.
+fn member_ident(name: &[u8], taken: &[&str]) -> String {
+    let mut id = ident(name);
+    while taken.contains(&id.as_str()) {
+        id.push('_');
+    }
+    id
+}
+
+// Checks that a namespace, possibly nested (`a::b`), is one the header
+// can be put in.
+fn namespace_ok(ns: &str) -> bool {
+    ns.split("::").all(|part| {
+        let bytes = part.as_bytes();
+        !bytes.is_empty() && !bytes[0].is_ascii_digit() &&
+        bytes.iter().all(|b| b.is_ascii_alphanumeric() || *b == b'_') &&
+        !KEYWORDS.contains(&part) && !RESERVED.contains(&part)
+    })
+}
+
+fn int_type(bytes: u32) -> &'static str {
+    match bytes {
+        1 => "uint8_t",
+        2 => "uint16_t",
+        8 => "uint64_t",
+        _ => "uint32_t",
+    }
+}
+
+fn core_type(ty: WASMType) -> &'static str {
+    match ty {
+        WASMType::I32 => "to_wit::core_type::I32",
+        WASMType::I64 => "to_wit::core_type::I64",
+        WASMType::F32 => "to_wit::core_type::F32",
+        WASMType::F64 => "to_wit::core_type::F64",
+    }
+}
+
+struct CppGen<'a> {
+    img:   ImageRef<'a>,
+    scope: String,          // Qualifier of the header's own types
+    names: Vec<String>,     // C++ name of each type, as used
+    done:  Vec<bool>,       // Types already emitted
+    out:   String,
+}
+
+impl<'a> CppGen<'a> {
+    fn new(img: ImageRef<'a>, ns: Option<&str>) -> CppGen<'a> {
+        let ntypes = img.types().len();
+        let mut g = CppGen {
+            img,
+            scope: ns.map_or_else(|| "::".to_string(), |ns| format!("::{}::", ns)),
+            names: Vec::with_capacity(ntypes),
+            done:  vec![false; ntypes],
+            out:   String::new(),
+        };
+        for idx in 0..ntypes as u32 {
+            let name = g.type_name(idx);
+            g.names.push(name);
+        }
+        g
+    }
+
+    // The name a type is declared under, if it's one that gets a
+    // declaration.  Anonymous types end in an underscore, which `ident`
+    // only adds to keywords and reserved names, so they can't clash with
+    // a named type.  Named types ending in `_func` get one too, so they
+    // can't clash with a function's `<name>_func`.
+    fn decl_name(&self, idx: u32) -> String {
+        let rec = self.img.ty(idx);
+        if rec.name != 0 {
+            let mut id = ident(self.img.name(rec.name));
+            if id.ends_with("_func") {
+                id.push('_');
+            }
+            id
+        } else {
+            format!("anon{}_", idx)
+        }
+    }
+
+    // Declared types are named in full wherever they're used, so that a
+    // member named after its own type (`point point;`) doesn't change what
+    // the name means inside the struct.
+    fn type_name(&self, idx: u32) -> String {
+        let rec = self.img.ty(idx);
+        // Handles are plain indices, whatever resource they name.
+        if rec.name != 0 && rec.kind() != WITType::Handle {
+            return format!("{}{}", self.scope, self.decl_name(idx));
+        }
+        let prim = match rec.kind() {
+            WITType::Unit    => "void",
+            WITType::Bool    => "uint8_t",
+            WITType::U8      => "uint8_t",
+            WITType::U16     => "uint16_t",
+            WITType::U32     => "uint32_t",
+            WITType::U64     => "uint64_t",
+            WITType::S8      => "int8_t",
+            WITType::S16     => "int16_t",
+            WITType::S32     => "int32_t",
+            WITType::S64     => "int64_t",
+            WITType::Float32 => "float",
+            WITType::Float64 => "double",
+            WITType::Char    => "char32_t",
+            WITType::String  => "to_wit::string",
+            WITType::Handle |
+            WITType::Stream  => "uint32_t",
+            WITType::List    => return format!("to_wit::list<{}>", self.type_name(rec.elem)),
+            WITType::Type    => return self.type_name(rec.elem),
+            _                => return format!("{}{}", self.scope, self.decl_name(idx)),
+        };
+        prim.to_string()
+    }
+
+    // Unit, and records, tuples and flags with nothing in them, take no
+    // space in the ABI, where any C++ member would take a byte.
+    fn is_zero_size(&self, idx: u32) -> bool {
+        self.img.ty(idx).size == 0
+    }
+
+    // Emits a type after everything it contains.
+    fn emit(&mut self, idx: u32) {
+        if self.done[idx as usize] {
+            return;
+        }
+        self.done[idx as usize] = true;
+        let img = self.img;
+        let rec = img.ty(idx);
+        for m in img.members(rec) {
+            self.emit(m.ty);
+        }
+        if matches!(rec.kind(), WITType::List | WITType::Type) {
+            self.emit(rec.elem);
+        }
+
+        let name = self.decl_name(idx);
+        let members = img.members(rec);
+        match rec.kind() {
+            WITType::Record | WITType::Tuple => {
+                // Empty fields get no member.
+                let fields: Vec<(String, u32, u32)> = members.iter()
+                    .enumerate()
+                    .filter(|(_, m)| !self.is_zero_size(m.ty))
+                    .map(|(i, m)| {
+                        let field = match rec.kind() {
+                            WITType::Record => member_ident(img.name(m.name), &[name.as_str()]),
+                            _ => format!("f{}", i),
+                        };
+                        (field, m.ty, m.offset)
+                    })
+                    .collect();
+                let _ = writeln!(self.out, "struct {} {{", name);
+                for (field, ty, _) in &fields {
+                    let _ = writeln!(self.out, "    {} {};", self.names[*ty as usize], field);
+                }
+                self.out.push_str("};\n");
+                self.assert_layout(&name, rec);
+                for (field, _, offset) in &fields {
+                    self.assert_offset(&name, field, *offset);
+                }
+            },
+            WITType::Flags => {
+                let flag = |m: &crate::WITTypeDef| member_ident(img.name(m.name), &[name.as_str(), "bits"]);
+                let _ = writeln!(self.out, "struct {} {{", name);
+                if rec.size > 0 && rec.size <= 4 {
+                    let bits = int_type(rec.size);
+                    let _ = writeln!(self.out, "    {} bits;", bits);
+                    for (i, m) in members.iter().enumerate() {
+                        let _ = writeln!(self.out, "    static constexpr {} {} = {}(1) << {};", bits, flag(m), bits, i);
+                    }
+                } else if rec.size > 4 {
+                    let _ = writeln!(self.out, "    uint32_t bits[{}];", rec.size / 4);
+                    self.out.push_str("    // Flag `n` is bit `n % 32` of `bits[n / 32]`.\n");
+                    for (i, m) in members.iter().enumerate() {
+                        let _ = writeln!(self.out, "    static constexpr unsigned {} = {};", flag(m), i);
+                    }
+                }
+                self.out.push_str("};\n");
+                self.assert_layout(&name, rec);
+            },
+            WITType::Enum => {
+                let _ = writeln!(self.out, "enum class {} : {} {{", name, int_type(rec.tag));
+                for m in members {
+                    let _ = writeln!(self.out, "    {},", member_ident(img.name(m.name), &[name.as_str()]));
+                }
+                self.out.push_str("};\n");
+                self.assert_layout(&name, rec);
+            },
+            WITType::Variant | WITType::Union => {
+                let case = |i: usize, m: &crate::WITTypeDef| match rec.kind() {
+                    WITType::Variant => member_ident(img.name(m.name), &[name.as_str()]),
+                    _ => format!("c{}", i),
+                };
+                let _ = writeln!(self.out, "struct {} {{", name);
+                let _ = writeln!(self.out, "    enum class cases : {} {{", int_type(rec.tag));
+                for (i, m) in members.iter().enumerate() {
+                    let _ = writeln!(self.out, "        {},", case(i, m));
+                }
+                self.out.push_str("    };\n    cases tag;\n");
+                let with_payload: Vec<(usize, &crate::WITTypeDef)> = members.iter()
+                    .enumerate()
+                    .filter(|(_, m)| !self.is_zero_size(m.ty))
+                    .collect();
+                if !with_payload.is_empty() {
+                    self.out.push_str("    union {\n");
+                    for (i, m) in &with_payload {
+                        let _ = writeln!(self.out, "        {} {};", self.names[m.ty as usize], case(*i, m));
+                    }
+                    self.out.push_str("    } payload;\n");
+                }
+                self.out.push_str("};\n");
+                self.assert_layout(&name, rec);
+                if !with_payload.is_empty() {
+                    self.assert_offset(&name, "payload", rec.payload);
+                }
+            },
+            WITType::Option => {
+                let _ = writeln!(self.out, "struct {} {{", name);
+                self.out.push_str("    uint8_t is_some;\n");
+                let value = members.get(0).map_or(0, |m| m.ty);
+                if !self.is_zero_size(value) {
+                    let _ = writeln!(self.out, "    {} value;", self.names[value as usize]);
+                }
+                self.out.push_str("};\n");
+                self.assert_layout(&name, rec);
+                if !self.is_zero_size(value) {
+                    self.assert_offset(&name, "value", rec.payload);
+                }
+            },
+            WITType::Expected => {
+                let _ = writeln!(self.out, "struct {} {{", name);
+                self.out.push_str("    uint8_t is_err;\n");
+                let (ok, err) = (members.get(0).map_or(0, |m| m.ty), members.get(1).map_or(0, |m| m.ty));
+                let payload = !self.is_zero_size(ok) || !self.is_zero_size(err);
+                if payload {
+                    self.out.push_str("    union {\n");
+                    for (ty, case) in [(ok, "ok"), (err, "err")] {
+                        if !self.is_zero_size(ty) {
+                            let _ = writeln!(self.out, "        {} {};", self.names[ty as usize], case);
+                        }
+                    }
+                    self.out.push_str("    } payload;\n");
+                }
+                self.out.push_str("};\n");
+                self.assert_layout(&name, rec);
+                if payload {
+                    self.assert_offset(&name, "payload", rec.payload);
+                }
+            },
+            WITType::List | WITType::Type if rec.name != 0 => {
+                let target = match rec.kind() {
+                    WITType::List => format!("to_wit::list<{}>", self.names[rec.elem as usize]),
+                    _ => self.names[rec.elem as usize].clone(),
+                };
+                let _ = writeln!(self.out, "using {} = {};", name, target);
+            },
+            _ => return,
+        }
+        self.out.push('\n');
+    }
+
+    fn assert_layout(&mut self, name: &str, rec: &TypeRec) {
+        // Empty C++ types still take a byte, where the ABI gives them none,
+        // so they're only tags, never members.
+        if rec.size > 0 {
+            let _ = writeln!(self.out, "static_assert(sizeof({}) == {} && alignof({}) == {}, \"layout of {}\");",
+                name, rec.size, name, rec.align, name);
+        }
+    }
+
+    fn assert_offset(&mut self, name: &str, field: &str, offset: u32) {
+        let _ = writeln!(self.out, "static_assert(offsetof({}, {}) == {}, \"offset of {}::{}\");",
+            name, field, offset, name, field);
+    }
+
+    // Emits a function's params, laid out as the ABI passes them in memory
+    // when they don't fit in core params, its result type and its core
+    // signature.
+    fn func(&mut self, func: &crate::WITFunction) {
+        let img = self.img;
+        let fname = ident(img.name(func.name));
+        let params = &img.typedefs()[func.param_first as usize..][..func.param_count as usize];
+        let _ = writeln!(self.out, "struct {}_func {{", fname);
+        let _ = writeln!(self.out, "    static constexpr const char* name = \"{}\";", String::from_utf8_lossy(img.name(func.name)));
+        self.out.push_str("    struct params {\n");
+        let (mut size, mut align) = (0, 1);
+        for p in params {
+            let rec = img.ty(p.ty);
+            size = (size + rec.align - 1) / rec.align * rec.align + rec.size;
+            align = align.max(rec.align);
+            if !self.is_zero_size(p.ty) {
+                let _ = writeln!(self.out, "        {} {};", self.names[p.ty as usize], ident(img.name(p.name)));
+            }
+        }
+        self.out.push_str("    };\n");
+        let _ = writeln!(self.out, "    using result = {};", self.names[func.result as usize]);
+        let sig = func.sig(WITAbiVariant::GuestExport);
+        for (part, start, len) in [("core_params", sig.params, sig.params_len), ("core_results", sig.results, sig.results_len)] {
+            let types: Vec<&str> = img.wasm()[start as usize..][..len as usize].iter()
+                .map(|t| core_type(*t))
+                .collect();
+            let _ = writeln!(self.out, "    static constexpr std::array<to_wit::core_type, {}> {} = {{{{{}}}}};",
+                len, part, types.join(", "));
+        }
+        let _ = writeln!(self.out, "    static constexpr bool indirect_params = {};", sig.indirect_params != 0);
+        let _ = writeln!(self.out, "    static constexpr bool retptr = {};", sig.retptr != 0);
+        self.out.push_str("};\n");
+        let size = (size + align - 1) / align * align;
+        if size > 0 {
+            let _ = writeln!(self.out, "static_assert(sizeof({}_func::params) == {}, \"layout of {} params\");", fname, size, fname);
+        }
+        self.out.push('\n');
+    }
+
+    fn header(mut self, ns: Option<&str>) -> String {
+        let mut head = String::from(PREAMBLE);
+        head.push('\n');
+        if let Some(ns) = ns {
+            let _ = writeln!(head, "namespace {} {{\n", ns);
+        }
+        // A WIT of one interface gets every type, used or not.  The table
+        // of one of several also holds the other interfaces' types, whose
+        // names may clash, so only what the first interface's functions
+        // use is emitted.
+        if self.img.interfaces().len() == 1 {
+            for idx in 0..self.img.types().len() as u32 {
+                self.emit(idx);
+            }
+        } else {
+            let img = self.img;
+            for func in img.main_funcs() {
+                for p in &img.typedefs()[func.param_first as usize..][..func.param_count as usize] {
+                    self.emit(p.ty);
+                }
+                self.emit(func.result);
+            }
+        }
+        for func in self.img.main_funcs() {
+            self.func(func);
+        }
+        head.push_str(&self.out);
+        if let Some(ns) = ns {
+            let _ = writeln!(head, "}}  // namespace {}", ns);
+        }
+        head
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Generates a C++ header for a spec, with every type in namespace `ns` (or
+// at global scope if `ns` is NULL), which must be a C++ identifier or
+// several joined by `::`.  For a WIT of several interfaces, the header
+// covers the first interface.  The header is copied into `out`, which
+// holds `cap` bytes, and `len` is set to its full length; as with
+// `wit_serialize`, nothing is copied if it doesn't fit, and `out` may be
+// NULL when `cap` is 0.
+#[no_mangle]
+pub extern "C" fn wit_codegen_cpp(s: *mut WITSession, wit: *const WIT, ns: *const c_char, out: *mut u8, cap: usize, len: *mut usize) -> bool {
+    ffi_return!(s, _wit_codegen_cpp(wit, ns, out, cap, len))
+}
+fn _wit_codegen_cpp(wit: *const WIT, ns: *const c_char, out: *mut u8, cap: usize, len: *mut usize) -> Result<()> {
+    if wit.is_null() || len.is_null() || (out.is_null() && cap > 0) {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let wit = unsafe {
+        &*wit
+    };
+    let ns = if ns.is_null() {
+        None
+    } else {
+        match unsafe { CStr::from_ptr(ns) }.to_str() {
+            Ok(ns) if namespace_ok(ns) => Some(ns),
+            _ => return Err(wit_err!(InvalidArgument, "Invalid argument; namespace must be a C++ identifier")),
+        }
+    };
+    let header = CppGen::new(wit.image.view(), ns).header(ns);
+    unsafe {
+        if header.len() <= cap {
+            ptr::copy_nonoverlapping(header.as_ptr(), out, header.len());
+        }
+        *len = header.len();
+    }
+    Ok(())
+}
@@ -0,0 +1,211 @@
+// Diffs between two parsed specs, e.g. an old and a redeployed version of
+// the same interface, so callers caching per-function state only have to
+// drop the entries for functions that actually changed.
+//
+// Parsing builds a spec's image in one flat pass, so there is little to
+// gain from reusing pieces of the old one; `wit_reparse` instead parses
+// the new text and reports what differs.
+
+use std::collections::HashMap;
+use std::ptr;
+use std::slice;
+
+use crate::{ImageRef, WIT, WITFunction, WITSession, WITType, utf8};
+use crate::error::{Result, check};
+use crate::alloc::{Allocator, delete_handle, hooks_of, new_handle};
+#[cfg(feature="catch_panics")]
+use crate::error::{WITErr, WITErrorCode, error_set};
+#[cfg(feature="catch_panics")]
+use std::panic::{catch_unwind, AssertUnwindSafe};
+
+#[derive(Clone, Copy, PartialEq)]
+#[repr(C)]
+pub enum WITChange {
+    Unchanged,
+    Changed,        // Same name, different params or result
+    Added,
+    Removed,
+}
+
+// One function of either spec.  Indices are `wit_func_get_by_index`
+// indices into the old and new specs; the one a function doesn't have
+// (the old index of an added function, the new index of a removed one) is
+// `SIZE_MAX`.
+#[repr(C)]
+pub struct WITDiffEntry {
+    pub change:    WITChange,
+    pub old_index: usize,
+    pub new_index: usize,
+}
+
+pub struct WITDiff {
+    entries: Vec<WITDiffEntry>,
+}
+
+impl WITDiff {
+    // Entries follow the new spec's function order, then come the
+    // removed functions in the old spec's order.
+    fn new(old: ImageRef, new: ImageRef) -> WITDiff {
+        let mut eq = TypeEq { old, new, seen: HashMap::new() };
+        let mut entries = Vec::with_capacity(new.main_funcs().len());
+        let mut kept = vec![false; old.main_funcs().len()];
+        for (new_index, nf) in new.main_funcs().iter().enumerate() {
+            let entry = match old.func_index(new.name(nf.name)) {
+                Some(old_index) => {
+                    kept[old_index] = true;
+                    let change =
+                        if eq.func(&old.main_funcs()[old_index], nf) {
+                            WITChange::Unchanged
+                        } else {
+                            WITChange::Changed
+                        };
+                    WITDiffEntry { change, old_index, new_index }
+                },
+                None => WITDiffEntry { change: WITChange::Added, old_index: usize::MAX, new_index },
+            };
+            entries.push(entry);
+        }
+        for (old_index, kept) in kept.iter().enumerate() {
+            if !kept {
+                entries.push(WITDiffEntry { change: WITChange::Removed, old_index, new_index: usize::MAX });
+            }
+        }
+        WITDiff { entries }
+    }
+}
+
+// Structural comparison of types across two images.  Names count: a
+// renamed field or case is a change even if the layout is the same, and
+// so is a handle to a different resource.
+struct TypeEq<'a> {
+    old:  ImageRef<'a>,
+    new:  ImageRef<'a>,
+    seen: HashMap<(u32, u32), bool>,    // Pairs already compared
+}
+
+impl<'a> TypeEq<'a> {
+    fn func(&mut self, a: &WITFunction, b: &WITFunction) -> bool {
+        let (old, new) = (self.old, self.new);
+        let pa = &old.typedefs()[a.param_first as usize..][..a.param_count as usize];
+        let pb = &new.typedefs()[b.param_first as usize..][..b.param_count as usize];
+        pa.len() == pb.len() &&
+            pa.iter().zip(pb).all(|(x, y)| old.name(x.name) == new.name(y.name) && self.ty(x.ty, y.ty)) &&
+            self.ty(a.result, b.result)
+    }
+
+    fn ty(&mut self, a: u32, b: u32) -> bool {
+        if let Some(eq) = self.seen.get(&(a, b)) {
+            return *eq;
+        }
+        let (old, new) = (self.old, self.new);
+        let (ra, rb) = (old.ty(a), new.ty(b));
+        let shallow =
+            ra.kind == rb.kind && ra.size == rb.size && ra.align == rb.align &&
+            ra.tag == rb.tag && ra.payload == rb.payload && ra.count == rb.count &&
+            old.name(ra.name) == new.name(rb.name);
+        // Types can't contain themselves, so no pair is revisited while it
+        // is still being compared.
+        let eq = shallow && {
+            let (ma, mb) = (old.members(ra), new.members(rb));
+            ma.iter().zip(mb).all(|(x, y)| {
+                x.offset == y.offset && old.name(x.name) == new.name(y.name) && self.ty(x.ty, y.ty)
+            }) && match ra.kind() {
+                WITType::List | WITType::Type | WITType::Stream => self.ty(ra.elem, rb.elem),
+                _ => true,
+            }
+        };
+        self.seen.insert((a, b), eq);
+        eq
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+#[no_mangle]
+pub extern "C" fn wit_diff(s: *mut WITSession, old_wit: *const WIT, new_wit: *const WIT, res: *mut *mut WITDiff) -> bool {
+    ffi_return!(s, _wit_diff(hooks_of(s), old_wit, new_wit, res))
+}
+fn _wit_diff(alloc: Option<Allocator>, old_wit: *const WIT, new_wit: *const WIT, res: *mut *mut WITDiff) -> Result<()> {
+    if old_wit.is_null() || new_wit.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let (old_wit, new_wit) = unsafe {
+        (&*old_wit, &*new_wit)
+    };
+    let safe_res = new_handle(alloc, WITDiff::new(old_wit.image.view(), new_wit.image.view()))?;
+    unsafe {
+        *res = safe_res;
+    }
+    Ok(())
+}
+
+// Parses a new version of a spec, and diffs it against the old one.  The
+// old spec is left as is.  `diff` may be NULL if only the new spec is
+// wanted.
+#[no_mangle]
+pub extern "C" fn wit_reparse(s: *mut WITSession, old_wit: *const WIT, content: *const u8, len: usize, res: *mut *mut WIT, diff: *mut *mut WITDiff) -> bool {
+    ffi_return!(s, _wit_reparse(hooks_of(s), old_wit, content, len, res, diff))
+}
+fn _wit_reparse(alloc: Option<Allocator>, old_wit: *const WIT, content: *const u8, len: usize, res: *mut *mut WIT, diff: *mut *mut WITDiff) -> Result<()> {
+    if old_wit.is_null() || content.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let old_wit = unsafe {
+        &*old_wit
+    };
+    let content = unsafe {
+        slice::from_raw_parts(content, len)
+    };
+    let content = utf8(content)?;
+    let new_wit = WIT::new(content, alloc)?;
+    let safe_diff = match diff.is_null() {
+        true => ptr::null_mut(),
+        false => new_handle(alloc, WITDiff::new(old_wit.image.view(), new_wit.image.view()))?,
+    };
+    let safe_res = match new_handle(alloc, new_wit) {
+        Ok(wit) => wit,
+        Err(e) => {
+            if !safe_diff.is_null() {
+                unsafe {
+                    delete_handle(safe_diff);
+                }
+            }
+            return Err(e);
+        },
+    };
+    unsafe {
+        if !diff.is_null() {
+            *diff = safe_diff;
+        }
+        *res = safe_res;
+    }
+    Ok(())
+}
+
+#[no_mangle]
+pub extern "C" fn wit_diff_delete(_s: *mut WITSession, diff: *mut WITDiff) {
+    if diff.is_null() {
+        return;
+    }
+    unsafe {
+        delete_handle(diff);
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn wit_diff_entries_get(s: *mut WITSession, diff: *const WITDiff, res: *mut *const WITDiffEntry, len: *mut usize) -> bool {
+    ffi_return!(s, _wit_diff_entries_get(diff, res, len))
+}
+fn _wit_diff_entries_get(diff: *const WITDiff, res: *mut *const WITDiffEntry, len: *mut usize) -> Result<()> {
+    if diff.is_null() || res.is_null() || len.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let diff = unsafe {
+        &*diff
+    };
+    unsafe {
+        *res = diff.entries.as_ptr();
+        *len = diff.entries.len();
+    }
+    Ok(())
+}
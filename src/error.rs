@@ -0,0 +1,251 @@
+// Error reporting.  Every error carries a code from a fixed set; its
+// message is only formatted when a caller asks for it with
+// `wit_error_get`, so failing a call (e.g. looking up a function that
+// isn't there) doesn't allocate a message.
+//
+// Errors are recorded in the session passed to the failing call.  Calls
+// made with a NULL session record theirs in a per-thread slot instead,
+// which is read back by passing NULL to `wit_error_get` and friends.
+
+use libc::c_char;
+use std::cell::{OnceCell, RefCell};
+use std::fmt;
+use std::ffi::NulError;
+use std::ptr;
+use std::str::Utf8Error;
+
+use crate::WITSession;
+use crate::alloc::{Allocator, Block};
+
+#[derive(Debug, PartialEq, Clone, Copy)]
+#[repr(C)]
+pub enum WITErrorCode {
+    None,               // No error recorded
+    InvalidArgument,    // NULL or otherwise unusable argument
+    NotFound,           // No function, field or file by that name
+    OutOfBounds,        // Iterator or index past the end
+    WrongType,          // Typedef isn't of the kind the call expects
+    Parse,              // Spec isn't UTF-8 or isn't valid WIT
+    Panic,              // A Rust panic was caught (`catch_panics`, or a background parse)
+    Format,             // Serialized WIT is corrupt or from another version
+    Io,                 // A file couldn't be opened or mapped
+    OutOfMemory,        // A session's allocator hook returned NULL
+    Cancelled,          // A background parse was cancelled
+    Internal,           // Anything else
+}
+
+pub(crate) type Result<T> = std::result::Result<T, WITErr>;
+
+// Builds a `WITErr` from a code and a static message.
+macro_rules! wit_err {
+    ($code: ident, $msg: expr) => {
+        crate::error::WITErr::new(crate::error::WITErrorCode::$code, $msg)
+    }
+}
+
+// Longest name kept by a "not found" error; longer names are truncated.
+const NAME_MAX: usize = 62;
+
+// A name copied inline, so keeping it doesn't allocate.
+struct InlineName {
+    len: u8,
+    buf: [u8; NAME_MAX],
+    truncated: bool,
+}
+impl InlineName {
+    fn new(name: &str) -> InlineName {
+        let mut len = name.len().min(NAME_MAX);
+        while !name.is_char_boundary(len) {
+            len -= 1;
+        }
+        let mut buf = [0; NAME_MAX];
+        buf[..len].copy_from_slice(&name.as_bytes()[..len]);
+        InlineName {
+            len: len as u8,
+            buf,
+            truncated: len < name.len(),
+        }
+    }
+
+    fn as_str(&self) -> &str {
+        // Always cut at a char boundary of a `str`.
+        std::str::from_utf8(&self.buf[..self.len as usize]).unwrap_or("")
+    }
+}
+
+enum Detail {
+    Static(&'static str),
+    FuncNotFound(InlineName),
+    Error(anyhow::Error),
+}
+
+pub struct WITErr {
+    code:   WITErrorCode,
+    detail: Detail,
+}
+impl WITErr {
+    pub(crate) fn new(code: WITErrorCode, msg: &'static str) -> WITErr {
+        WITErr {
+            code,
+            detail: Detail::Static(msg),
+        }
+    }
+
+    pub(crate) fn func_not_found(name: &[u8]) -> WITErr {
+        WITErr {
+            code:   WITErrorCode::NotFound,
+            detail: Detail::FuncNotFound(InlineName::new(&String::from_utf8_lossy(name))),
+        }
+    }
+
+    // Wraps an error from a dependency (the parser, UTF-8 validation, ...).
+    pub(crate) fn wrap(code: WITErrorCode, err: anyhow::Error) -> WITErr {
+        WITErr {
+            code,
+            detail: Detail::Error(err),
+        }
+    }
+
+    pub(crate) fn code(&self) -> WITErrorCode {
+        self.code
+    }
+}
+impl fmt::Display for WITErr {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        match &self.detail {
+            Detail::Static(msg) => f.write_str(msg),
+            Detail::FuncNotFound(name) => {
+                let more = if name.truncated { "..." } else { "" };
+                write!(f, "Function `{}{}` not found", name.as_str(), more)
+            },
+            Detail::Error(err) => write!(f, "{}", err),
+        }
+    }
+}
+impl fmt::Debug for WITErr {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(f, "{:?}: {}", self.code, self)
+    }
+}
+impl From<Utf8Error> for WITErr {
+    fn from(_: Utf8Error) -> Self {
+        wit_err!(InvalidArgument, "Invalid argument; not valid UTF-8")
+    }
+}
+impl From<NulError> for WITErr {
+    fn from(_: NulError) -> Self {
+        wit_err!(InvalidArgument, "Invalid argument; contains a NUL byte")
+    }
+}
+
+// Returned by `wit_error_get` if there's no room for the real message.
+const NO_ROOM: &[u8] = b"Out of memory formatting error message\0";
+
+// The most recent error of a session or thread.
+#[derive(Default)]
+pub(crate) struct ErrorSlot {
+    err:   Option<WITErr>,
+    c_msg: OnceCell<Option<Block>>,    // `err` formatted, on first request
+    alloc: Option<Allocator>,           // Where `c_msg` is allocated
+}
+impl ErrorSlot {
+    pub(crate) fn new(alloc: Option<Allocator>) -> ErrorSlot {
+        ErrorSlot { alloc, ..ErrorSlot::default() }
+    }
+
+    fn set(&mut self, err: WITErr) {
+        self.err = Some(err);
+        self.c_msg = OnceCell::new();
+    }
+
+    fn clear(&mut self) {
+        self.err = None;
+        self.c_msg = OnceCell::new();
+    }
+
+    fn code(&self) -> WITErrorCode {
+        match &self.err {
+            Some(e) => e.code(),
+            None => WITErrorCode::None,
+        }
+    }
+
+    fn msg(&self) -> *const c_char {
+        match &self.err {
+            Some(e) => {
+                let c_msg = self.c_msg.get_or_init(|| {
+                    let msg = e.to_string();
+                    stat_add!(error_strings, 1);
+                    stat_add!(bytes_allocated, msg.len() + 1);
+                    // The block is zeroed, so comes NUL-terminated.
+                    let block = Block::new(self.alloc, msg.len() + 1).ok()?;
+                    for (i, b) in msg.bytes().enumerate() {
+                        // Messages never contain NULs, but don't fail on one.
+                        unsafe {
+                            *block.as_ptr().add(i) = if b == 0 { b' ' } else { b };
+                        }
+                    }
+                    Some(block)
+                });
+                match c_msg {
+                    Some(block) => block.as_ptr() as *const c_char,
+                    None => NO_ROOM.as_ptr() as *const c_char,
+                }
+            },
+            None => ptr::null(),
+        }
+    }
+}
+
+thread_local! {
+    static THREAD_ERROR: RefCell<ErrorSlot> = RefCell::new(ErrorSlot::default());
+}
+
+// Runs `f` on the error slot for `s`: the session's own if there is one,
+// else the calling thread's.
+fn with_slot<R>(s: *const WITSession, f: impl FnOnce(&mut ErrorSlot) -> R) -> R {
+    if s.is_null() {
+        THREAD_ERROR.with(|slot| f(&mut slot.borrow_mut()))
+    } else {
+        // Sessions are only ever handed out as `*mut`.
+        f(unsafe { &mut (*(s as *mut WITSession)).error })
+    }
+}
+
+pub(crate) fn error_set(s: *mut WITSession, err: WITErr) {
+    with_slot(s, |slot| slot.set(err))
+}
+
+// Checks the result for an error.  If present, records it in the error
+// slot for `s` and returns false.  If no error, true is returned.
+pub(crate) fn check(s: *mut WITSession, r: Result<()>) -> bool {
+    match r {
+        Ok(()) => true,
+        Err(err) => {
+            error_set(s, err);
+            false
+        },
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Returns the message of the last error, or NULL if there is none.  The
+// string stays valid until the next error is recorded in the same slot,
+// or the slot is cleared.
+#[no_mangle]
+pub extern "C" fn wit_error_get(s: *const WITSession) -> *const c_char {
+    let msg = with_slot(s, |slot| slot.msg());
+    stat_flush!(s as *mut WITSession);
+    msg
+}
+
+#[no_mangle]
+pub extern "C" fn wit_error_code_get(s: *const WITSession) -> WITErrorCode {
+    with_slot(s, |slot| slot.code())
+}
+
+#[no_mangle]
+pub extern "C" fn wit_error_clear(s: *mut WITSession) {
+    with_slot(s, |slot| slot.clear())
+}
@@ -0,0 +1,157 @@
+// ABI fingerprints: a 64-bit structural hash of each type and function,
+// worked out when a spec is parsed and stored in its image.
+//
+// A type's fingerprint covers everything `wit_diff` compares -- kind,
+// size, alignment, tag and payload layout, its own name, and the names,
+// offsets and fingerprints of its members -- and a function's adds its
+// name, its param names and both flattened signatures.  Type table
+// indices never go in, so equal fingerprints mean equal ABIs (barring a
+// hash collision) across specs and across redeploys of the same one.
+
+use std::mem::size_of;
+
+use crate::{TypeRec, WITFunction, WITSession, WITType, WITTypeDef, record};
+use crate::error::{Result, check};
+use crate::image::{SOURCE_HASH_START, source_hash_more};
+#[cfg(feature="catch_panics")]
+use crate::error::{WITErr, WITErrorCode, error_set};
+#[cfg(feature="catch_panics")]
+use std::panic::{catch_unwind, AssertUnwindSafe};
+
+// The source hash, fed a word at a time.
+struct Hasher(u64);
+impl Hasher {
+    fn new() -> Hasher {
+        Hasher(SOURCE_HASH_START)
+    }
+
+    fn bytes(&mut self, bytes: &[u8]) {
+        self.0 = source_hash_more(self.0, bytes);
+    }
+
+    fn word(&mut self, w: u32) {
+        self.bytes(&w.to_le_bytes());
+    }
+
+    fn print(&mut self, p: u64) {
+        self.bytes(&p.to_le_bytes());
+    }
+
+    // Names are length-prefixed, so neighbouring names can't run together.
+    fn name(&mut self, name: &[u8]) {
+        self.word(name.len() as u32);
+        self.bytes(name);
+    }
+}
+
+pub(crate) struct PrintBuilder<'a> {
+    types:    &'a [TypeRec],
+    typedefs: &'a [WITTypeDef],
+    wasm:     &'a [u32],
+    names:    &'a [u8],
+    prints:   Vec<Option<u64>>,     // Of each type, once known
+}
+
+impl<'a> PrintBuilder<'a> {
+    pub(crate) fn new(types: &'a [TypeRec], typedefs: &'a [WITTypeDef], wasm: &'a [u32], names: &'a [u8]) -> PrintBuilder<'a> {
+        PrintBuilder { types, typedefs, wasm, names, prints: vec![None; types.len()] }
+    }
+
+    fn name(&self, off: u32) -> &'a [u8] {
+        let tail = &self.names[off as usize..];
+        &tail[..tail.iter().position(|b| *b == 0).unwrap_or(tail.len())]
+    }
+
+    fn ty(&mut self, ty: u32) -> u64 {
+        if let Some(p) = self.prints[ty as usize] {
+            return p;
+        }
+        let rec = &self.types[ty as usize];
+        let mut h = Hasher::new();
+        for w in [rec.kind, rec.size, rec.align, rec.tag, rec.payload, rec.count] {
+            h.word(w);
+        }
+        h.name(self.name(rec.name));
+        // Types can't contain themselves, so this always bottoms out.
+        for m in &self.typedefs[rec.first as usize..][..rec.count as usize] {
+            h.word(m.offset);
+            h.name(self.name(m.name));
+            h.print(self.ty(m.ty));
+        }
+        if let WITType::List | WITType::Type | WITType::Stream = rec.kind() {
+            h.print(self.ty(rec.elem));
+        }
+        self.prints[ty as usize] = Some(h.0);
+        h.0
+    }
+
+    pub(crate) fn func(&mut self, f: &WITFunction) -> u64 {
+        let mut h = Hasher::new();
+        h.name(self.name(f.name));
+        h.word(f.param_count);
+        for p in &self.typedefs[f.param_first as usize..][..f.param_count as usize] {
+            h.name(self.name(p.name));
+            h.print(self.ty(p.ty));
+        }
+        h.print(self.ty(f.result));
+        for sig in &f.sigs {
+            for (first, len) in [(sig.params, sig.params_len), (sig.results, sig.results_len)] {
+                h.word(len);
+                for t in &self.wasm[first as usize..][..len as usize] {
+                    h.word(*t);
+                }
+            }
+            h.word(sig.indirect_params);
+            h.word(sig.retptr);
+        }
+        h.0
+    }
+
+    // Fingerprints of every type, then of every function.
+    pub(crate) fn all(mut self, funcs: &[WITFunction]) -> Vec<u64> {
+        let mut res: Vec<u64> = (0..self.types.len() as u32).map(|ty| self.ty(ty)).collect();
+        res.extend(funcs.iter().map(|f| self.func(f)));
+        res
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Gets a function's fingerprint, e.g. as a cache key for anything built
+// from its signature.
+#[no_mangle]
+pub extern "C" fn wit_func_fingerprint_get(s: *mut WITSession, func: *const WITFunction, res: *mut u64) -> bool {
+    ffi_return!(s, _wit_func_fingerprint_get(func, res))
+}
+fn _wit_func_fingerprint_get(func: *const WITFunction, res: *mut u64) -> Result<()> {
+    if func.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let (img, func) = unsafe {
+        record(func)
+    };
+    let idx = (func as *const WITFunction as usize - img.funcs().as_ptr() as usize) / size_of::<WITFunction>();
+    unsafe {
+        *res = img.prints()[img.types().len() + idx];
+    }
+    Ok(())
+}
+
+// Gets the fingerprint of a typedef's type.  The typedef's own name and
+// offset, as a field or param, aren't part of it.
+#[no_mangle]
+pub extern "C" fn wit_typedef_fingerprint_get(s: *mut WITSession, td: *const WITTypeDef, res: *mut u64) -> bool {
+    ffi_return!(s, _wit_typedef_fingerprint_get(td, res))
+}
+fn _wit_typedef_fingerprint_get(td: *const WITTypeDef, res: *mut u64) -> Result<()> {
+    if td.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let (img, td) = unsafe {
+        record(td)
+    };
+    unsafe {
+        *res = img.prints()[td.ty as usize];
+    }
+    Ok(())
+}
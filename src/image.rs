@@ -0,0 +1,1476 @@
+// Compiled images: the flat, self-contained form every parsed WIT is kept
+// in.  An image is a header followed by arrays of fixed-size records, and
+// holds everything the accessors need -- the type table, typedefs,
+// functions, signatures, sizes and offsets -- so it can be written out
+// with `wit_serialize` and read back with `wit_load` without going
+// through the text parser again.
+//
+// Records refer to each other by index and to names by offset into one
+// string pool, never by pointer.  Each record that is handed out to C
+// (typedefs, functions, signatures) also knows its own offset within the
+// image, which is how an accessor finds the rest of the image from it.
+//
+// Images are in native byte order; a header field records which, and an
+// image from a machine of the other order is rejected.  All fields are
+// 32 bits, so one image is good for 32- and 64-bit builds alike.
+
+use libc::c_char;
+use std::collections::HashMap;
+use std::mem::size_of;
+use std::ptr;
+use std::slice;
+use parser::{Function, Interface, Int, Type, TypeDefKind, SizeAlign};
+use parser::abi;
+
+use crate::{WIT, WITAbiVariant, WITFunction, WITSession, WITSignature, WITType, WITTypeDef, WASMType};
+use crate::error::{Result, check};
+use crate::alloc::{Allocator, Block, hooks_of, new_handle};
+use crate::plan::{self, PlanBuilder, WITPlanStep};
+use crate::fingerprint::PrintBuilder;
+use crate::interface::WITInterface;
+#[cfg(feature="catch_panics")]
+use crate::error::{WITErr, WITErrorCode};
+#[cfg(unix)]
+use crate::mapping::Mapping;
+#[cfg(feature="catch_panics")]
+use crate::error::error_set;
+#[cfg(feature="catch_panics")]
+use std::panic::{catch_unwind, AssertUnwindSafe};
+
+const MAGIC:   [u8; 8] = *b"TO-WIT\0\0";
+const VERSION: u32     = 9;
+const ENDIAN:  u32     = 0x0102_0304;
+
+// Primitive types occupy the first entries of the type table, in
+// `WITType` order, followed by one entry per resource handle and then the
+// interface's own types.
+const PRIMS: usize = WITType::String as usize + 1;
+
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+struct Section {
+    offset: u32,    // Byte offset from the start of the image
+    count:  u32,    // Number of records
+}
+
+const SEC_TYPES:    usize = 0;  // TypeRec
+const SEC_TYPEDEFS: usize = 1;  // WITTypeDef
+const SEC_FUNCS:    usize = 2;  // WITFunction
+const SEC_WASM:     usize = 3;  // WASMType, as u32
+const SEC_STEPS:    usize = 4;  // WITPlanStep
+const SEC_PATHS:    usize = 5;  // u32 member index per call plan path element
+const SEC_SEEDS:    usize = 6;  // u32 name index seed per bucket
+const SEC_SLOTS:    usize = 7;  // u32 interface function index per slot, or `NO_FUNC`
+const SEC_NAMES:    usize = 8;  // NUL-terminated names, back to back
+const SEC_PRINTS:   usize = 9;  // u64 fingerprint per type, then per function
+const SEC_IFACES:   usize = 10; // WITInterface
+const SECTIONS:     usize = 11;
+
+// An empty slot of the name index.
+const NO_FUNC: u32 = u32::MAX;
+
+#[repr(C)]
+struct Header {
+    magic:    [u8; 8],
+    version:  u32,
+    endian:   u32,
+    hash:     u64,      // Hash of the source text (see `source_hash`)
+    len:      u64,      // Length of the whole image in bytes
+    sections: [Section; SECTIONS],
+}
+
+// One entry of the type table.
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+pub(crate) struct TypeRec {
+    pub(crate) kind:    u32,    // WITType
+    pub(crate) size:    u32,
+    pub(crate) align:   u32,
+    pub(crate) tag:     u32,    // Tag size in bytes (variant, enum, union, option, expected)
+    pub(crate) payload: u32,    // Payload offset (variant, union, option, expected)
+    pub(crate) first:   u32,    // Members: fields, cases, flags, `ok`/`err`, ...
+    pub(crate) count:   u32,
+    pub(crate) elem:    u32,    // Element/aliased type (list, type, stream)
+    pub(crate) name:    u32,    // Name of a named type, else the empty name
+    pub(crate) resolved: u32,   // First type down an alias chain that isn't an alias; else the type itself
+}
+impl TypeRec {
+    pub(crate) fn kind(&self) -> WITType {
+        // Checked when the image is built or loaded.
+        WITType::from_u32(self.kind).unwrap_or(WITType::Unit)
+    }
+}
+
+// FNV-1a.  Stable across builds and platforms, which is all that's
+// needed to notice that a cached image no longer matches its source.
+pub(crate) fn source_hash(src: &[u8]) -> u64 {
+    source_hash_more(SOURCE_HASH_START, src)
+}
+
+pub(crate) const SOURCE_HASH_START: u64 = 0xcbf2_9ce4_8422_2325;
+
+// Continues a hash over the next part of the source, for text that
+// arrives in pieces.
+pub(crate) fn source_hash_more(mut h: u64, src: &[u8]) -> u64 {
+    for b in src {
+        h ^= *b as u64;
+        h = h.wrapping_mul(0x0000_0100_0000_01b3);
+    }
+    h
+}
+
+// The function name index is a perfect hash built when the image is: each
+// name hashes to a bucket, and the bucket's seed sends it to a slot of its
+// own.  A lookup is one hash of the name, two reads and one compare.
+fn name_bucket(h: u64, buckets: usize) -> usize {
+    ((h >> 32) % buckets as u64) as usize
+}
+
+fn name_slot(h: u64, seed: u32, slots: usize) -> usize {
+    // splitmix64's finalizer, so each seed gives an unrelated spread.
+    let mut x = h ^ (seed as u64).wrapping_mul(0x9e37_79b9_7f4a_7c15);
+    x = (x ^ (x >> 30)).wrapping_mul(0xbf58_476d_1ce4_e5b9);
+    x = (x ^ (x >> 27)).wrapping_mul(0x94d0_49bb_1331_11eb);
+    x ^= x >> 31;
+    (x % slots as u64) as usize
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Where an image's bytes live.  Either way they are 8-byte aligned, so
+// every record is suitably aligned.
+enum Backing {
+    Owned(Block),
+    #[cfg(unix)]
+    Mapped(Mapping),        // A read-only mapping of a file
+    Borrowed(*const u8),    // The caller's memory, which outlives the image
+}
+
+pub(crate) struct Image {
+    backing: Backing,
+    len:     usize,
+}
+impl Image {
+    pub(crate) fn bytes(&self) -> &[u8] {
+        let start = match &self.backing {
+            Backing::Owned(buf) => buf.as_ptr() as *const u8,
+            #[cfg(unix)]
+            Backing::Mapped(map) => map.bytes().as_ptr(),
+            Backing::Borrowed(start) => *start,
+        };
+        unsafe { slice::from_raw_parts(start, self.len) }
+    }
+
+    pub(crate) fn view(&self) -> ImageRef<'_> {
+        ImageRef { bytes: self.bytes() }
+    }
+
+    // Copies and checks a serialized image.
+    fn load(bytes: &[u8], alloc: Option<Allocator>) -> Result<Image> {
+        let buf = Block::new(alloc, bytes.len())?;
+        unsafe {
+            ptr::copy_nonoverlapping(bytes.as_ptr(), buf.as_ptr(), bytes.len());
+        }
+        stat_add!(bytes_allocated, buf.size());
+        let img = Image { backing: Backing::Owned(buf), len: bytes.len() };
+        validate(img.bytes())?;
+        Ok(img)
+    }
+
+    // Checks a serialized image in place, without copying it.
+    //
+    // Safety: `bytes` must stay valid and unchanged for the image's life.
+    unsafe fn borrow(bytes: &[u8]) -> Result<Image> {
+        if bytes.as_ptr() as usize % 8 != 0 {
+            return Err(wit_err!(InvalidArgument, "Invalid argument; must be 8-byte aligned"));
+        }
+        validate(bytes)?;
+        Ok(Image { backing: Backing::Borrowed(bytes.as_ptr()), len: bytes.len() })
+    }
+
+    // Maps a serialized image from a file and checks it in place.
+    #[cfg(unix)]
+    fn map(map: Mapping) -> Result<Image> {
+        let len = map.bytes().len();
+        let img = Image { backing: Backing::Mapped(map), len };
+        validate(img.bytes())?;
+        Ok(img)
+    }
+}
+
+// Images are never written after they are built, whatever backs them.
+unsafe impl Send for Image {}
+unsafe impl Sync for Image {}
+
+// A view of a checked image.
+#[derive(Clone, Copy)]
+pub(crate) struct ImageRef<'a> {
+    bytes: &'a [u8],
+}
+impl<'a> ImageRef<'a> {
+    // Finds the image a record handed out from it lives in.  A pointer made
+    // from a reference to the record can only reach the record, so this
+    // takes the pointer `handle` gave out.
+    //
+    // Safety: `rec` must come from `handle` on a live image, and be `base`
+    // bytes from its start.
+    pub(crate) unsafe fn of<T>(rec: *const T, base: u32) -> ImageRef<'a> {
+        let start = (rec as *const u8).sub(base as usize);
+        let hdr = &*(start as *const Header);
+        ImageRef { bytes: slice::from_raw_parts(start, hdr.len as usize) }
+    }
+
+    // The pointer to hand out for a record of this image (or the end of a
+    // run of them).  It is made from the image's own pointer, so `of` can
+    // get back to the whole image from it.
+    pub(crate) fn handle<T>(&self, rec: *const T) -> *const T {
+        let off = rec as usize - self.bytes.as_ptr() as usize;
+        debug_assert!(off <= self.bytes.len());
+        self.bytes.as_ptr().wrapping_add(off) as *const T
+    }
+
+    fn header(&self) -> &'a Header {
+        unsafe { &*(self.bytes.as_ptr() as *const Header) }
+    }
+
+    fn section<T>(&self, idx: usize) -> &'a [T] {
+        let sec = &self.header().sections[idx];
+        unsafe {
+            slice::from_raw_parts(
+                self.bytes.as_ptr().add(sec.offset as usize) as *const T,
+                sec.count as usize,
+            )
+        }
+    }
+
+    pub(crate) fn hash(&self) -> u64 {
+        self.header().hash
+    }
+
+    pub(crate) fn types(&self) -> &'a [TypeRec] {
+        self.section(SEC_TYPES)
+    }
+
+    pub(crate) fn typedefs(&self) -> &'a [WITTypeDef] {
+        self.section(SEC_TYPEDEFS)
+    }
+
+    pub(crate) fn funcs(&self) -> &'a [WITFunction] {
+        self.section(SEC_FUNCS)
+    }
+
+    pub(crate) fn wasm(&self) -> &'a [WASMType] {
+        self.section(SEC_WASM)
+    }
+
+    pub(crate) fn steps(&self) -> &'a [WITPlanStep] {
+        self.section(SEC_STEPS)
+    }
+
+    pub(crate) fn paths(&self) -> &'a [u32] {
+        self.section(SEC_PATHS)
+    }
+
+    pub(crate) fn prints(&self) -> &'a [u64] {
+        self.section(SEC_PRINTS)
+    }
+
+    pub(crate) fn interfaces(&self) -> &'a [WITInterface] {
+        self.section(SEC_IFACES)
+    }
+
+    // An interface's functions, a run of the function table.
+    pub(crate) fn iface_funcs(&self, iface: &WITInterface) -> &'a [WITFunction] {
+        &self.funcs()[iface.func_first as usize..][..iface.func_count as usize]
+    }
+
+    // The functions of the first interface, which is the only one unless
+    // the WIT came from `wit_parse_interfaces`.  Calls on the WIT as a
+    // whole see these.
+    pub(crate) fn main_funcs(&self) -> &'a [WITFunction] {
+        self.iface_funcs(&self.interfaces()[0])
+    }
+
+    // Index within an interface of its function with the given name, if
+    // there is one.  Each interface has its own run of the name index.
+    pub(crate) fn iface_func_index(&self, iface: &WITInterface, name: &[u8]) -> Option<usize> {
+        let seeds: &[u32] = &self.section::<u32>(SEC_SEEDS)[iface.seed_first as usize..][..iface.seed_count as usize];
+        let slots: &[u32] = &self.section::<u32>(SEC_SLOTS)[iface.slot_first as usize..][..iface.slot_count as usize];
+        let h = source_hash(name);
+        let seed = seeds[name_bucket(h, seeds.len())];
+        let idx = slots[name_slot(h, seed, slots.len())];
+        if idx == NO_FUNC || self.name(self.iface_funcs(iface)[idx as usize].name) != name {
+            return None;
+        }
+        Some(idx as usize)
+    }
+
+    // Index in `main_funcs` of the function with the given name, if there
+    // is one.
+    pub(crate) fn func_index(&self, name: &[u8]) -> Option<usize> {
+        self.iface_func_index(&self.interfaces()[0], name)
+    }
+
+    pub(crate) fn names(&self) -> &'a [u8] {
+        self.section(SEC_NAMES)
+    }
+
+    pub(crate) fn ty(&self, idx: u32) -> &'a TypeRec {
+        &self.types()[idx as usize]
+    }
+
+    // The unnamed typedef of a type.  It has the same index as the type.
+    pub(crate) fn typedef(&self, ty: u32) -> &'a WITTypeDef {
+        &self.typedefs()[ty as usize]
+    }
+
+    // The members of a type (fields, cases, flags, ...).
+    pub(crate) fn members(&self, ty: &TypeRec) -> &'a [WITTypeDef] {
+        &self.typedefs()[ty.first as usize..(ty.first + ty.count) as usize]
+    }
+
+    pub(crate) fn name_ptr(&self, off: u32) -> *const c_char {
+        self.names()[off as usize..].as_ptr() as *const c_char
+    }
+
+    // A name's bytes, without the NUL.
+    pub(crate) fn name(&self, off: u32) -> &'a [u8] {
+        let tail = &self.names()[off as usize..];
+        let len = tail.iter().position(|b| *b == 0).unwrap_or(tail.len());
+        &tail[..len]
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Checks that a serialized image is one this build can read, and that
+// every index and offset in it stays in bounds, so accessors can trust it.
+fn validate(bytes: &[u8]) -> Result<()> {
+    let bad = || wit_err!(Format, "Invalid serialized WIT");
+    if bytes.len() < size_of::<Header>() {
+        return Err(bad());
+    }
+    let hdr = unsafe { &*(bytes.as_ptr() as *const Header) };
+    if hdr.magic != MAGIC || hdr.endian != ENDIAN {
+        return Err(bad());
+    }
+    if hdr.version != VERSION {
+        return Err(wit_err!(Format, "Serialized WIT is from an incompatible version"));
+    }
+    if hdr.len != bytes.len() as u64 {
+        return Err(bad());
+    }
+    let sizes = [
+        size_of::<TypeRec>(),
+        size_of::<WITTypeDef>(),
+        size_of::<WITFunction>(),
+        size_of::<u32>(),
+        size_of::<WITPlanStep>(),
+        size_of::<u32>(),
+        size_of::<u32>(),
+        size_of::<u32>(),
+        1,
+        size_of::<u64>(),
+        size_of::<WITInterface>(),
+    ];
+    for (sec, size) in hdr.sections.iter().zip(sizes) {
+        let end = sec.offset as u64 + sec.count as u64 * size as u64;
+        if sec.offset % 8 != 0 || (sec.offset as usize) < size_of::<Header>() || end > hdr.len {
+            return Err(bad());
+        }
+    }
+
+    let img = ImageRef { bytes };
+    let ntypes = img.types().len() as u64;
+    let ntypedefs = img.typedefs().len() as u64;
+    let nwasm = img.section::<u32>(SEC_WASM).len() as u64;
+    let nsteps = img.section::<u32>(SEC_STEPS).len() as u64;
+    let npaths = img.paths().len();
+    let names = img.names();
+    if names.last() != Some(&0) || ntypes < PRIMS as u64 || ntypedefs < ntypes ||
+       img.prints().len() != img.types().len() + img.funcs().len() {
+        return Err(bad());
+    }
+    let name_ok = |off: u32| (off as usize) < names.len();
+    let base_of = |sec: usize, size: usize, i: usize| {
+        hdr.sections[sec].offset as u64 + (i * size) as u64
+    };
+
+    for ty in img.types() {
+        if WITType::from_u32(ty.kind).is_none() || !name_ok(ty.name) ||
+           ty.elem as u64 >= ntypes || ty.first as u64 + ty.count as u64 > ntypedefs ||
+           !ty.align.is_power_of_two() || ty.resolved as u64 >= ntypes {
+            return Err(bad());
+        }
+    }
+    // The primitives come first, just as the builder puts them, and every
+    // record has the element and members its kind calls for.
+    let prim_sizes = SizeAlign::default();
+    for (ty, prim) in img.types().iter().zip(PRIM_TYPES.iter()) {
+        if ty.kind != prim_kind(prim) as u32 || ty.size != prim_sizes.size(prim) as u32 ||
+           ty.align != prim_sizes.align(prim) as u32 || ty.name != 0 {
+            return Err(bad());
+        }
+    }
+    for ty in img.types() {
+        let members_ok = match ty.kind() {
+            WITType::Option => ty.count == 1,
+            WITType::Expected => ty.count == 2,
+            WITType::Record | WITType::Tuple | WITType::Flags | WITType::Enum |
+            WITType::Variant | WITType::Union => true,
+            _ => ty.count == 0,
+        };
+        if !members_ok || (!has_elem(ty.kind()) && ty.elem != 0) {
+            return Err(bad());
+        }
+    }
+    // An alias resolves as its target does, anything else to itself.
+    for (i, ty) in img.types().iter().enumerate() {
+        let want = match ty.kind() {
+            WITType::Type => img.ty(ty.elem).resolved,
+            _ => i as u32,
+        };
+        if ty.resolved != want {
+            return Err(bad());
+        }
+    }
+    for (i, td) in img.typedefs().iter().enumerate() {
+        if td.base as u64 != base_of(SEC_TYPEDEFS, size_of::<WITTypeDef>(), i) ||
+           !name_ok(td.name) || td.ty as u64 >= ntypes {
+            return Err(bad());
+        }
+    }
+    for (i, f) in img.funcs().iter().enumerate() {
+        let base = base_of(SEC_FUNCS, size_of::<WITFunction>(), i);
+        if f.base as u64 != base || !name_ok(f.name) || f.result as u64 >= ntypes ||
+           f.param_first as u64 + f.param_count as u64 > ntypedefs {
+            return Err(bad());
+        }
+        for (v, sig) in f.sigs.iter().enumerate() {
+            if sig.base as u64 != base + sig_offset(v) ||
+               sig.params as u64 + sig.params_len as u64 > nwasm ||
+               sig.results as u64 + sig.results_len as u64 > nwasm {
+                return Err(bad());
+            }
+        }
+        // Steps are checked as plain words before they are read as steps.
+        if f.plan_first == plan::NO_PLAN {
+            if f.plan_count != 0 {
+                return Err(bad());
+            }
+        } else {
+            if f.plan_first as u64 + f.plan_count as u64 > nsteps {
+                return Err(bad());
+            }
+            let steps = &img.section::<plan::RawStep>(SEC_STEPS)[f.plan_first as usize..][..f.plan_count as usize];
+            if !plan::plan_ok(steps, npaths, f.sig(WITAbiVariant::GuestExport)) {
+                return Err(bad());
+            }
+        }
+    }
+    if img.section::<u32>(SEC_WASM).iter().any(|t| *t > WASMType::F64 as u32) {
+        return Err(bad());
+    }
+    let nfuncs = img.funcs().len() as u64;
+    let nseeds = img.section::<u32>(SEC_SEEDS).len() as u64;
+    let slots = img.section::<u32>(SEC_SLOTS);
+    if img.interfaces().is_empty() {
+        return Err(bad());
+    }
+    for (i, iface) in img.interfaces().iter().enumerate() {
+        if iface.base as u64 != base_of(SEC_IFACES, size_of::<WITInterface>(), i) ||
+           !name_ok(iface.name) ||
+           iface.func_first as u64 + iface.func_count as u64 > nfuncs ||
+           iface.seed_count == 0 || iface.seed_first as u64 + iface.seed_count as u64 > nseeds ||
+           iface.slot_count == 0 || iface.slot_first as u64 + iface.slot_count as u64 > slots.len() as u64 {
+            return Err(bad());
+        }
+        let iface_slots = &slots[iface.slot_first as usize..][..iface.slot_count as usize];
+        if iface_slots.iter().any(|i| *i != NO_FUNC && *i >= iface.func_count) {
+            return Err(bad());
+        }
+        // Every function must be found by its own name.
+        for (i, f) in img.iface_funcs(iface).iter().enumerate() {
+            if img.iface_func_index(iface, img.name(f.name)) != Some(i) {
+                return Err(bad());
+            }
+        }
+    }
+    if !acyclic(&img) {
+        return Err(bad());
+    }
+    Ok(())
+}
+
+// Checks that no type contains itself, which walks over the image rely
+// on.  The parser never produces such types, but a damaged image could.
+fn acyclic(img: &ImageRef) -> bool {
+    const NEW: u8 = 0;
+    const OPEN: u8 = 1;
+    const DONE: u8 = 2;
+    let types = img.types();
+    let mut state = vec![NEW; types.len()];
+    let mut stack: Vec<(u32, usize)> = Vec::new();
+    for root in 0..types.len() as u32 {
+        if state[root as usize] != NEW {
+            continue;
+        }
+        state[root as usize] = OPEN;
+        stack.push((root, 0));
+        // Each entry is a type and how many of its contained types have
+        // already been visited; the element type comes last.
+        while let Some((ty, next)) = stack.pop() {
+            let rec = &types[ty as usize];
+            let members = img.members(rec);
+            let child = if next < members.len() {
+                Some(members[next].ty)
+            } else if next == members.len() && has_elem(rec.kind()) {
+                Some(rec.elem)
+            } else {
+                None
+            };
+            match child {
+                Some(child) => {
+                    stack.push((ty, next + 1));
+                    match state[child as usize] {
+                        OPEN => return false,
+                        NEW => {
+                            state[child as usize] = OPEN;
+                            stack.push((child, 0));
+                        },
+                        _ => {},
+                    }
+                },
+                None => state[ty as usize] = DONE,
+            }
+        }
+    }
+    true
+}
+
+// Whether records of a kind have an element or aliased type.  Others
+// leave `elem` at 0, which is also a real type (`unit`), so this is the
+// only way to tell.
+pub(crate) fn has_elem(kind: WITType) -> bool {
+    matches!(kind, WITType::List | WITType::Type | WITType::Stream)
+}
+
+// Offset of a function record's signature for the given variant.
+fn sig_offset(variant: usize) -> u64 {
+    let f = WITFunction::default();
+    (&f.sigs[variant] as *const WITSignature as usize - &f as *const WITFunction as usize) as u64
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Builds the image of one or more parsed interfaces.
+pub(crate) fn compile(ifaces: &[Interface], hash: u64, alloc: Option<Allocator>) -> Result<Image> {
+    let mut b = ImageBuilder::new(ifaces);
+    stat_time!(build_ns, {
+        b.types();
+        b.funcs();
+        b.dedup();
+        b.resolve();
+        b.plans();
+        b.finish(hash, alloc)
+    })
+}
+
+struct ImageBuilder<'a> {
+    ifaces:    &'a [Interface],
+    sizes:     Vec<SizeAlign>,      // Of each interface
+    cur:       usize,               // Interface being added
+    res_base:  Vec<usize>,          // Type index of each interface's first handle
+    type_base: Vec<usize>,          // Type index of each interface's first own type
+    types:     Vec<TypeRec>,
+    typedefs:  Vec<WITTypeDef>,
+    funcs:     Vec<WITFunction>,
+    iface_recs: Vec<WITInterface>,
+    wasm:      Vec<u32>,
+    steps:     Vec<WITPlanStep>,
+    paths:     Vec<u32>,
+    names:     Vec<u8>,
+    name_offs: HashMap<&'a str, u32>,
+}
+
+impl<'a> ImageBuilder<'a> {
+    fn new(ifaces: &'a [Interface]) -> ImageBuilder<'a> {
+        let sizes = stat_time!(size_ns, ifaces.iter().map(|iface| {
+            let mut sizes = SizeAlign::default();
+            sizes.fill(iface);
+            sizes
+        }).collect());
+        // The type, typedef and function tables are sized up front, so
+        // each is allocated once.
+        let ntypes = PRIMS + ifaces.iter().map(|i| i.resources.len() + i.types.len()).sum::<usize>();
+        let nmembers: usize = ifaces.iter().flat_map(|i| i.types.iter()).map(|(_, td)| member_count(&td.kind)).sum();
+        let nparams: usize = ifaces.iter().flat_map(|i| &i.functions).map(|f| f.params.len()).sum();
+        let nfuncs: usize = ifaces.iter().map(|i| i.functions.len()).sum();
+        let mut b = ImageBuilder {
+            ifaces,
+            sizes,
+            cur:       0,
+            res_base:  Vec::with_capacity(ifaces.len()),
+            type_base: Vec::with_capacity(ifaces.len()),
+            types:     Vec::with_capacity(ntypes),
+            typedefs:  Vec::with_capacity(ntypes + nmembers + nparams),
+            funcs:     Vec::with_capacity(nfuncs),
+            iface_recs: Vec::with_capacity(ifaces.len()),
+            wasm:      Vec::new(),
+            steps:     Vec::new(),
+            paths:     Vec::new(),
+            names:     Vec::new(),
+            name_offs: HashMap::with_capacity(ntypes + nmembers + nparams + nfuncs + ifaces.len()),
+        };
+        // The empty name is always at offset 0.
+        b.name("");
+        b
+    }
+
+    fn iface(&self) -> &'a Interface {
+        &self.ifaces[self.cur]
+    }
+
+    fn sizes(&self) -> &SizeAlign {
+        &self.sizes[self.cur]
+    }
+
+    // Interns a name into the string pool, returning its offset.
+    fn name(&mut self, name: &'a str) -> u32 {
+        if let Some(off) = self.name_offs.get(name) {
+            return *off;
+        }
+        let off = self.names.len() as u32;
+        self.names.extend_from_slice(name.as_bytes());
+        self.names.push(0);
+        self.name_offs.insert(name, off);
+        off
+    }
+
+    fn type_index(&self, ty: &Type) -> u32 {
+        let idx = match ty {
+            Type::Handle(id) => self.res_base[self.cur] + id.index(),
+            Type::Id(id)     => self.type_base[self.cur] + id.index(),
+            _                => prim_kind(ty) as usize,
+        };
+        idx as u32
+    }
+
+    fn member(&mut self, name: &'a str, ty: &Type, offset: usize) {
+        let rec = WITTypeDef {
+            base:   0,
+            name:   self.name(name),
+            ty:     self.type_index(ty),
+            offset: offset as u32,
+        };
+        self.typedefs.push(rec);
+    }
+
+    fn push_type(&mut self, kind: WITType, ty: &Type) -> usize {
+        self.types.push(
+            TypeRec {
+                kind:  kind as u32,
+                size:  self.sizes().size(ty) as u32,
+                align: self.sizes().align(ty) as u32,
+                ..TypeRec::default()
+            }
+        );
+        self.types.len() - 1
+    }
+
+    // Fills the type table, and the unnamed typedef and members of each
+    // type.
+    fn types(&mut self) {
+        for ty in PRIM_TYPES.iter() {
+            self.push_type(prim_kind(ty), ty);
+        }
+        for k in 0..self.ifaces.len() {
+            self.cur = k;
+            let iface = self.iface();
+            self.res_base.push(self.types.len());
+            for (id, res) in iface.resources.iter() {
+                // A handle is named for its resource, which is all that
+                // tells two handles apart.
+                let idx = self.push_type(WITType::Handle, &Type::Handle(id));
+                self.types[idx].name = self.name(&res.name);
+            }
+            self.type_base.push(self.types.len());
+            for (id, td) in iface.types.iter() {
+                let idx = self.push_type(kind_of(&td.kind), &Type::Id(id));
+                if let Some(name) = &td.name {
+                    self.types[idx].name = self.name(name);
+                }
+            }
+        }
+
+        // Unnamed typedefs share the type's index.
+        for i in 0..self.types.len() {
+            self.typedefs.push(
+                WITTypeDef {
+                    base:   0,
+                    name:   0,
+                    ty:     i as u32,
+                    offset: 0,
+                }
+            );
+        }
+
+        for k in 0..self.ifaces.len() {
+            self.cur = k;
+            let iface = self.iface();
+            for (id, td) in iface.types.iter() {
+                let idx = self.type_index(&Type::Id(id)) as usize;
+                let first = self.typedefs.len();
+                let mut rec = self.types[idx];
+                match &td.kind {
+                    TypeDefKind::Record(r) => {
+                        let offs = field_offsets(self.sizes(), r.fields.iter().map(|f| &f.ty));
+                        for (f, off) in r.fields.iter().zip(offs) {
+                            self.member(&f.name, &f.ty, off);
+                        }
+                    },
+                    TypeDefKind::Tuple(t) => {
+                        let offs = field_offsets(self.sizes(), t.types.iter());
+                        for (t, off) in t.types.iter().zip(offs) {
+                            self.member("", t, off);
+                        }
+                    },
+                    TypeDefKind::Flags(f) => {
+                        for flag in &f.flags {
+                            self.member(&flag.name, &Type::Unit, 0);
+                        }
+                    },
+                    TypeDefKind::Enum(e) => {
+                        rec.tag = int_size(e.tag()) as u32;
+                        for case in &e.cases {
+                            self.member(&case.name, &Type::Unit, 0);
+                        }
+                    },
+                    TypeDefKind::Variant(v) => {
+                        let payload = payload_offset(self.sizes(), v.tag(), v.cases.iter().map(|c| &c.ty));
+                        rec.tag = int_size(v.tag()) as u32;
+                        rec.payload = payload as u32;
+                        for case in &v.cases {
+                            self.member(&case.name, &case.ty, payload);
+                        }
+                    },
+                    TypeDefKind::Union(u) => {
+                        let payload = payload_offset(self.sizes(), u.tag(), u.cases.iter().map(|c| &c.ty));
+                        rec.tag = int_size(u.tag()) as u32;
+                        rec.payload = payload as u32;
+                        for case in &u.cases {
+                            self.member("", &case.ty, payload);
+                        }
+                    },
+                    TypeDefKind::Option(t) => {
+                        let payload = payload_offset(self.sizes(), Int::U8, [t]);
+                        rec.tag = 1;
+                        rec.payload = payload as u32;
+                        self.member("", t, payload);
+                    },
+                    TypeDefKind::Expected(e) => {
+                        let payload = payload_offset(self.sizes(), Int::U8, [&e.ok, &e.err]);
+                        rec.tag = 1;
+                        rec.payload = payload as u32;
+                        self.member("ok", &e.ok, payload);
+                        self.member("err", &e.err, payload);
+                    },
+                    TypeDefKind::List(t) |
+                    TypeDefKind::Type(t) => rec.elem = self.type_index(t),
+                    TypeDefKind::Stream(s) => rec.elem = self.type_index(&s.element),
+                }
+                rec.first = first as u32;
+                rec.count = (self.typedefs.len() - first) as u32;
+                self.types[idx] = rec;
+            }
+        }
+    }
+
+    fn funcs(&mut self) {
+        for k in 0..self.ifaces.len() {
+            self.cur = k;
+            let iface = self.iface();
+            let func_first = self.funcs.len() as u32;
+            self.iface_funcs();
+            let rec = WITInterface {
+                name:       self.name(&iface.name),
+                func_first,
+                func_count: self.funcs.len() as u32 - func_first,
+                ..WITInterface::default()
+            };
+            self.iface_recs.push(rec);
+        }
+    }
+
+    fn iface_funcs(&mut self) {
+        let iface = self.iface();
+        for func in &iface.functions {
+            let param_first = self.typedefs.len() as u32;
+            for (pname, pty) in &func.params {
+                self.member(pname, pty, 0);
+            }
+            let mut sigs = [WITSignature::default(), WITSignature::default()];
+            for (variant, abi_variant) in [
+                (WITAbiVariant::GuestExport, abi::AbiVariant::GuestExport),
+                (WITAbiVariant::GuestImport, abi::AbiVariant::GuestImport),
+            ] {
+                let sig = iface.wasm_signature(abi_variant, func);
+                let params = self.wasm.len() as u32;
+                self.wasm.extend(sig.params.iter().map(|t| WASMType::from(*t) as u32));
+                let results = self.wasm.len() as u32;
+                self.wasm.extend(sig.results.iter().map(|t| WASMType::from(*t) as u32));
+                sigs[variant as usize] =
+                    WITSignature {
+                        base:            0,
+                        params,
+                        params_len:      sig.params.len() as u32,
+                        results,
+                        results_len:     sig.results.len() as u32,
+                        indirect_params: sig.indirect_params as u32,
+                        retptr:          sig.retptr as u32,
+                    };
+            }
+            let rec = WITFunction {
+                base:        0,
+                name:        self.name(&func.name),
+                param_first,
+                param_count: func.params.len() as u32,
+                result:      self.type_index(&func.result),
+                plan_first:  0,
+                plan_count:  0,
+                sigs,
+            };
+            self.funcs.push(rec);
+        }
+    }
+
+    // Merges structurally identical types across interfaces, so each is
+    // kept once however many interfaces use it.  Two types are the same
+    // if their records match, members and all, with contained types
+    // compared the same way; the first of them is kept.  Handles are never
+    // merged, as each stands for its own resource.  An image of one
+    // interface is left as it is.
+    fn dedup(&mut self) {
+        if self.ifaces.len() < 2 {
+            return;
+        }
+        let ntypes = self.types.len();
+        let mut canon: Vec<Option<u32>> = vec![None; ntypes];
+        let mut seen: HashMap<Vec<u32>, u32> = HashMap::with_capacity(ntypes);
+        for ty in 0..ntypes as u32 {
+            self.canon(ty, &mut canon, &mut seen);
+        }
+        if seen.len() == ntypes {
+            return;
+        }
+
+        // New index of each type, by way of the one it is merged into.
+        let canon: Vec<u32> = canon.into_iter().map(|c| c.unwrap_or(0)).collect();
+        let mut remap = vec![0u32; ntypes];
+        let mut kept = Vec::with_capacity(seen.len());
+        for ty in 0..ntypes {
+            if canon[ty] as usize == ty {
+                remap[ty] = kept.len() as u32;
+                kept.push(ty);
+            }
+        }
+        for ty in 0..ntypes {
+            remap[ty] = remap[canon[ty] as usize];
+        }
+
+        let cap = self.typedefs.len();
+        let old = std::mem::replace(&mut self.typedefs, Vec::with_capacity(cap));
+        for i in 0..kept.len() {
+            self.typedefs.push(WITTypeDef { base: 0, name: 0, ty: i as u32, offset: 0 });
+        }
+        let mut types = Vec::with_capacity(kept.len());
+        for ty in kept {
+            let mut rec = self.types[ty];
+            let first = self.typedefs.len() as u32;
+            for m in &old[rec.first as usize..][..rec.count as usize] {
+                self.typedefs.push(WITTypeDef { base: 0, name: m.name, ty: remap[m.ty as usize], offset: m.offset });
+            }
+            rec.first = first;
+            rec.elem = remap[rec.elem as usize];
+            types.push(rec);
+        }
+        self.types = types;
+        for f in self.funcs.iter_mut() {
+            let first = self.typedefs.len() as u32;
+            for p in &old[f.param_first as usize..][..f.param_count as usize] {
+                self.typedefs.push(WITTypeDef { base: 0, name: p.name, ty: remap[p.ty as usize], offset: p.offset });
+            }
+            f.param_first = first;
+            f.result = remap[f.result as usize];
+        }
+    }
+
+    // The first type structurally identical to `ty`.
+    fn canon(&self, ty: u32, canon: &mut Vec<Option<u32>>, seen: &mut HashMap<Vec<u32>, u32>) -> u32 {
+        if let Some(c) = canon[ty as usize] {
+            return c;
+        }
+        let rec = self.types[ty as usize];
+        let mut key = vec![rec.kind, rec.size, rec.align, rec.tag, rec.payload, rec.count, rec.name];
+        match rec.kind() {
+            WITType::Handle => key.push(ty),
+            // Types can't contain themselves, so this always bottoms out.
+            kind if has_elem(kind) => key.push(self.canon(rec.elem, canon, seen)),
+            _ => {},
+        }
+        for i in rec.first..rec.first + rec.count {
+            let m = &self.typedefs[i as usize];
+            key.extend([m.offset, m.name, self.canon(m.ty, canon, seen)]);
+        }
+        let c = *seen.entry(key).or_insert(ty);
+        canon[ty as usize] = Some(c);
+        c
+    }
+
+    // Resolves every alias chain, so `wit_typedef_resolved_get` is one
+    // lookup.
+    fn resolve(&mut self) {
+        for ty in 0..self.types.len() {
+            let mut t = ty;
+            // Types can't contain themselves, so this always ends.
+            while self.types[t].kind() == WITType::Type {
+                t = self.types[t].elem as usize;
+            }
+            self.types[ty].resolved = t as u32;
+        }
+    }
+
+    // Works out every function's call plan from the finished type table.
+    fn plans(&mut self) {
+        let mut pb = PlanBuilder::new(&self.types, &self.typedefs);
+        for f in self.funcs.iter_mut() {
+            let params = &self.typedefs[f.param_first as usize..][..f.param_count as usize];
+            let (first, count) = pb.func(params, f.result, &f.sigs[WITAbiVariant::GuestExport as usize], &self.wasm)
+                .unwrap_or((plan::NO_PLAN, 0));
+            f.plan_first = first;
+            f.plan_count = count;
+        }
+        self.steps = pb.steps;
+        self.paths = pb.paths;
+    }
+
+    // Builds an interface's function name index: a seed per bucket, and
+    // the function in each slot.  Buckets are placed biggest first, each
+    // with the first seed that puts all of its names in free slots.  About
+    // four names share a bucket, and a fifth of the slots are left spare so
+    // seeds are quick to find; if one can't be found, the table is grown.
+    fn name_index(funcs: &[Function]) -> Result<(Vec<u32>, Vec<u32>)> {
+        const TRIES: u32 = 1 << 16;
+        let hashes: Vec<u64> = funcs.iter().map(|f| source_hash(f.name.as_bytes())).collect();
+        let nbuckets = (funcs.len() + 3) / 4 + 1;
+        let mut nslots = funcs.len() + funcs.len() / 4 + 1;
+        // Buckets are runs of one array, `members[starts[b]..starts[b + 1]]`,
+        // rather than a vector each.
+        let mut starts = vec![0u32; nbuckets + 1];
+        for h in &hashes {
+            starts[name_bucket(*h, nbuckets) + 1] += 1;
+        }
+        for b in 0..nbuckets {
+            starts[b + 1] += starts[b];
+        }
+        let mut members = vec![0u32; funcs.len()];
+        let mut fill = starts.clone();
+        for (i, h) in hashes.iter().enumerate() {
+            let b = name_bucket(*h, nbuckets);
+            members[fill[b] as usize] = i as u32;
+            fill[b] += 1;
+        }
+        let bucket = |b: usize| &members[starts[b] as usize..starts[b + 1] as usize];
+        let mut order: Vec<usize> = (0..nbuckets).collect();
+        order.sort_by_key(|b| std::cmp::Reverse(bucket(*b).len()));
+
+        'grow: loop {
+            let mut seeds = vec![0u32; nbuckets];
+            let mut slots = vec![NO_FUNC; nslots];
+            let mut taken = Vec::new();
+            for b in order.iter().copied() {
+                let bucket = bucket(b);
+                if bucket.is_empty() {
+                    break;
+                }
+                let found = (0..TRIES).find(|seed| {
+                    taken.clear();
+                    for i in bucket {
+                        let slot = name_slot(hashes[*i as usize], *seed, nslots);
+                        if slots[slot] != NO_FUNC || taken.contains(&slot) {
+                            return false;
+                        }
+                        taken.push(slot);
+                    }
+                    true
+                });
+                match found {
+                    Some(seed) => {
+                        seeds[b] = seed;
+                        for (i, slot) in bucket.iter().zip(&taken) {
+                            slots[*slot] = *i;
+                        }
+                    },
+                    None => {
+                        // Only names with the same hash can't be placed
+                        // in a table this much bigger than needed.
+                        if nslots > 64 * (funcs.len() + 1) {
+                            return Err(wit_err!(Internal, "Could not build function name index"));
+                        }
+                        nslots *= 2;
+                        continue 'grow;
+                    },
+                }
+            }
+            return Ok((seeds, slots));
+        }
+    }
+
+    // Lays everything out in one buffer, filling in each handed-out
+    // record's own offset on the way.
+    fn finish(mut self, hash: u64, alloc: Option<Allocator>) -> Result<Image> {
+        let mut seeds = Vec::new();
+        let mut slots = Vec::new();
+        for (iface, rec) in self.ifaces.iter().zip(self.iface_recs.iter_mut()) {
+            let (iface_seeds, iface_slots) = Self::name_index(&iface.functions)?;
+            rec.seed_first = seeds.len() as u32;
+            rec.seed_count = iface_seeds.len() as u32;
+            rec.slot_first = slots.len() as u32;
+            rec.slot_count = iface_slots.len() as u32;
+            seeds.extend(iface_seeds);
+            slots.extend(iface_slots);
+        }
+        let prints = PrintBuilder::new(&self.types, &self.typedefs, &self.wasm, &self.names).all(&self.funcs);
+
+        let counts = [
+            (self.types.len(),    size_of::<TypeRec>()),
+            (self.typedefs.len(), size_of::<WITTypeDef>()),
+            (self.funcs.len(),    size_of::<WITFunction>()),
+            (self.wasm.len(),     size_of::<u32>()),
+            (self.steps.len(),    size_of::<WITPlanStep>()),
+            (self.paths.len(),    size_of::<u32>()),
+            (seeds.len(),         size_of::<u32>()),
+            (slots.len(),         size_of::<u32>()),
+            (self.names.len(),    1),
+            (prints.len(),        size_of::<u64>()),
+            (self.iface_recs.len(), size_of::<WITInterface>()),
+        ];
+        let mut sections = [Section::default(); SECTIONS];
+        let mut len = size_of::<Header>();
+        for (sec, (count, size)) in sections.iter_mut().zip(counts) {
+            len = align_to(len, 8);
+            sec.offset = len as u32;
+            sec.count = count as u32;
+            len += count * size;
+        }
+        if len > u32::MAX as usize {
+            return Err(wit_err!(Internal, "Spec too large to compile"));
+        }
+
+        let td_base = sections[SEC_TYPEDEFS].offset as usize;
+        for (i, td) in self.typedefs.iter_mut().enumerate() {
+            td.base = (td_base + i * size_of::<WITTypeDef>()) as u32;
+        }
+        let func_base = sections[SEC_FUNCS].offset as usize;
+        for (i, f) in self.funcs.iter_mut().enumerate() {
+            f.base = (func_base + i * size_of::<WITFunction>()) as u32;
+            for (v, sig) in f.sigs.iter_mut().enumerate() {
+                sig.base = f.base + sig_offset(v) as u32;
+            }
+        }
+        let iface_base = sections[SEC_IFACES].offset as usize;
+        for (i, rec) in self.iface_recs.iter_mut().enumerate() {
+            rec.base = (iface_base + i * size_of::<WITInterface>()) as u32;
+        }
+
+        let hdr = Header {
+            magic:   MAGIC,
+            version: VERSION,
+            endian:  ENDIAN,
+            hash,
+            len:     len as u64,
+            sections,
+        };
+        let buf = Block::new(alloc, len)?;
+        let out = buf.as_ptr();
+        unsafe {
+            put(out, 0, slice::from_ref(&hdr));
+            put(out, sections[SEC_TYPES].offset, &self.types);
+            put(out, sections[SEC_TYPEDEFS].offset, &self.typedefs);
+            put(out, sections[SEC_FUNCS].offset, &self.funcs);
+            put(out, sections[SEC_WASM].offset, &self.wasm);
+            put(out, sections[SEC_STEPS].offset, &self.steps);
+            put(out, sections[SEC_PATHS].offset, &self.paths);
+            put(out, sections[SEC_SEEDS].offset, &seeds);
+            put(out, sections[SEC_SLOTS].offset, &slots);
+            put(out, sections[SEC_NAMES].offset, &self.names);
+            put(out, sections[SEC_PRINTS].offset, &prints);
+            put(out, sections[SEC_IFACES].offset, &self.iface_recs);
+        }
+        stat_add!(typedefs, self.typedefs.len());
+        stat_add!(names, self.name_offs.len());
+        stat_add!(name_bytes, self.names.len());
+        stat_add!(bytes_allocated, buf.size());
+        Ok(Image { backing: Backing::Owned(buf), len })
+    }
+}
+
+// Copies records into the image buffer at byte offset `off`.
+unsafe fn put<T>(out: *mut u8, off: u32, items: &[T]) {
+    ptr::copy_nonoverlapping(
+        items.as_ptr() as *const u8,
+        out.add(off as usize),
+        items.len() * size_of::<T>(),
+    );
+}
+
+const PRIM_TYPES: [Type; PRIMS] = [
+    Type::Unit,
+    Type::Bool,
+    Type::U8,
+    Type::U16,
+    Type::U32,
+    Type::U64,
+    Type::S8,
+    Type::S16,
+    Type::S32,
+    Type::S64,
+    Type::Float32,
+    Type::Float64,
+    Type::Char,
+    Type::String,
+];
+
+fn prim_kind(ty: &Type) -> WITType {
+    match ty {
+        Type::Unit => WITType::Unit,
+        Type::Bool => WITType::Bool,
+        Type::U8 => WITType::U8,
+        Type::U16 => WITType::U16,
+        Type::U32 => WITType::U32,
+        Type::U64 => WITType::U64,
+        Type::S8 => WITType::S8,
+        Type::S16 => WITType::S16,
+        Type::S32 => WITType::S32,
+        Type::S64 => WITType::S64,
+        Type::Float32 => WITType::Float32,
+        Type::Float64 => WITType::Float64,
+        Type::Char => WITType::Char,
+        Type::String => WITType::String,
+        Type::Handle(_) => WITType::Handle,
+        Type::Id(_) => WITType::Type,
+    }
+}
+
+fn kind_of(kind: &TypeDefKind) -> WITType {
+    match kind {
+        TypeDefKind::Flags(_) => WITType::Flags,
+        TypeDefKind::Expected(_) => WITType::Expected,
+        TypeDefKind::Option(_) => WITType::Option,
+        TypeDefKind::Union(_) => WITType::Union,
+        TypeDefKind::Enum(_) => WITType::Enum,
+        TypeDefKind::Tuple(_) => WITType::Tuple,
+        TypeDefKind::Record(_) => WITType::Record,
+        TypeDefKind::List(_) => WITType::List,
+        TypeDefKind::Variant(_) => WITType::Variant,
+        TypeDefKind::Type(_) => WITType::Type,
+        TypeDefKind::Stream(_) => WITType::Stream,
+    }
+}
+
+// The number of members `types` gives a type of this kind.
+fn member_count(kind: &TypeDefKind) -> usize {
+    match kind {
+        TypeDefKind::Record(r)   => r.fields.len(),
+        TypeDefKind::Tuple(t)    => t.types.len(),
+        TypeDefKind::Flags(f)    => f.flags.len(),
+        TypeDefKind::Enum(e)     => e.cases.len(),
+        TypeDefKind::Variant(v)  => v.cases.len(),
+        TypeDefKind::Union(u)    => u.cases.len(),
+        TypeDefKind::Option(_)   => 1,
+        TypeDefKind::Expected(_) => 2,
+        TypeDefKind::List(_) |
+        TypeDefKind::Type(_) |
+        TypeDefKind::Stream(_)   => 0,
+    }
+}
+
+fn align_to(val: usize, align: usize) -> usize {
+    (val + align - 1) & !(align - 1)
+}
+
+fn int_size(int: Int) -> usize {
+    match int {
+        Int::U8  => 1,
+        Int::U16 => 2,
+        Int::U32 => 4,
+        Int::U64 => 8,
+    }
+}
+
+fn field_offsets<'a>(sizes: &SizeAlign, types: impl Iterator<Item = &'a Type>) -> Vec<usize> {
+    let mut off = 0;
+    types.map(|ty| {
+        let field_off = align_to(off, sizes.align(ty));
+        off = field_off + sizes.size(ty);
+        field_off
+    }).collect()
+}
+
+fn payload_offset<'a, I: IntoIterator<Item = &'a Type>>(sizes: &SizeAlign, tag: Int, types: I) -> usize {
+    let max_align = types.into_iter()
+        .map(|ty| sizes.align(ty))
+        .max()
+        .unwrap_or(1);
+    align_to(int_size(tag), max_align)
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Copies the serialized form of a WIT into `out`, which holds `cap`
+// bytes, and sets `len` to its full length.  If `len` comes back larger
+// than `cap`, nothing was copied; `out` may be NULL when `cap` is 0, to
+// just query the length.
+#[no_mangle]
+pub extern "C" fn wit_serialize(s: *mut WITSession, wit: *const WIT, out: *mut u8, cap: usize, len: *mut usize) -> bool {
+    ffi_return!(s, _wit_serialize(wit, out, cap, len))
+}
+fn _wit_serialize(wit: *const WIT, out: *mut u8, cap: usize, len: *mut usize) -> Result<()> {
+    if wit.is_null() || len.is_null() || (out.is_null() && cap > 0) {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let wit = unsafe {
+        &*wit
+    };
+    let bytes = wit.image.bytes();
+    unsafe {
+        if bytes.len() <= cap {
+            ptr::copy_nonoverlapping(bytes.as_ptr(), out, bytes.len());
+        }
+        *len = bytes.len();
+    }
+    Ok(())
+}
+
+// Loads a WIT from the output of `wit_serialize`.  The bytes are copied,
+// so they needn't outlive the WIT.
+#[no_mangle]
+pub extern "C" fn wit_load(s: *mut WITSession, bytes: *const u8, len: usize, res: *mut *mut WIT) -> bool {
+    ffi_return!(s, _wit_load(hooks_of(s), bytes, len, res))
+}
+fn _wit_load(alloc: Option<Allocator>, bytes: *const u8, len: usize, res: *mut *mut WIT) -> Result<()> {
+    if bytes.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let bytes = unsafe {
+        slice::from_raw_parts(bytes, len)
+    };
+    let image = Image::load(bytes, alloc)?;
+    let safe_res = new_handle(alloc, WIT { image })?;
+    unsafe {
+        *res = safe_res;
+    }
+    Ok(())
+}
+
+// Loads a WIT from a file holding the output of `wit_serialize`, by
+// mapping it rather than reading it.  Nothing is copied: accessors read
+// straight from the mapping, and names are pointers into it.  The file
+// must not be modified while the WIT is in use.
+#[cfg(unix)]
+#[no_mangle]
+pub extern "C" fn wit_load_mmap(s: *mut WITSession, path: *const c_char, res: *mut *mut WIT) -> bool {
+    ffi_return!(s, _wit_load_mmap(hooks_of(s), path, res))
+}
+#[cfg(unix)]
+fn _wit_load_mmap(alloc: Option<Allocator>, path: *const c_char, res: *mut *mut WIT) -> Result<()> {
+    if path.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let image = Image::map(Mapping::open_c(path)?)?;
+    let safe_res = new_handle(alloc, WIT { image })?;
+    unsafe {
+        *res = safe_res;
+    }
+    Ok(())
+}
+
+// Like `wit_load`, but uses the bytes in place instead of copying them,
+// e.g. for a spec the caller has mapped itself.  They must be 8-byte
+// aligned, and stay valid and unchanged until the WIT is deleted.
+#[no_mangle]
+pub extern "C" fn wit_load_borrowed(s: *mut WITSession, bytes: *const u8, len: usize, res: *mut *mut WIT) -> bool {
+    ffi_return!(s, _wit_load_borrowed(hooks_of(s), bytes, len, res))
+}
+fn _wit_load_borrowed(alloc: Option<Allocator>, bytes: *const u8, len: usize, res: *mut *mut WIT) -> Result<()> {
+    if bytes.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let image = unsafe {
+        Image::borrow(slice::from_raw_parts(bytes, len))?
+    };
+    let safe_res = new_handle(alloc, WIT { image })?;
+    unsafe {
+        *res = safe_res;
+    }
+    Ok(())
+}
+
+// Gets the hash of the source a WIT was parsed from.  Compare it with
+// `wit_source_hash` of the current source to tell whether a serialized
+// WIT is stale.
+#[no_mangle]
+pub extern "C" fn wit_hash_get(s: *mut WITSession, wit: *const WIT, res: *mut u64) -> bool {
+    ffi_return!(s, _wit_hash_get(wit, res))
+}
+fn _wit_hash_get(wit: *const WIT, res: *mut u64) -> Result<()> {
+    if wit.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let wit = unsafe {
+        &*wit
+    };
+    unsafe {
+        *res = wit.image.view().hash();
+    }
+    Ok(())
+}
+
+#[no_mangle]
+pub extern "C" fn wit_source_hash(s: *mut WITSession, content: *const u8, len: usize, res: *mut u64) -> bool {
+    ffi_return!(s, _wit_source_hash(content, len, res))
+}
+fn _wit_source_hash(content: *const u8, len: usize, res: *mut u64) -> Result<()> {
+    if content.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let content = unsafe {
+        slice::from_raw_parts(content, len)
+    };
+    unsafe {
+        *res = source_hash(content);
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::error::WITErrorCode;
+
+    const SPEC: &str = "\
+record point {
+    x: s32,
+    y: s32,
+}
+
+type pt = point
+
+variant shape {
+    dot(point),
+    line(tuple<point, point>),
+    empty,
+}
+
+flags perms {
+    read,
+    write,
+}
+
+area: func(s: shape) -> float64
+shift: func(p: pt, by: list<pt>) -> option<point>
+check: func(p: perms) -> expected<u32, string>
+";
+
+    fn load_err(bytes: &[u8]) -> Option<WITErrorCode> {
+        Image::load(bytes, None).err().map(|e| e.code())
+    }
+
+    #[test]
+    fn serialize_load_round_trip() {
+        let wit = WIT::new(SPEC, None).unwrap();
+        let bytes = wit.image.bytes();
+        validate(bytes).unwrap();
+        let loaded = Image::load(bytes, None).unwrap();
+        assert_eq!(loaded.bytes(), bytes);
+        let img = loaded.view();
+        assert_eq!(img.hash(), source_hash(SPEC.as_bytes()));
+        for name in ["area", "shift", "check"] {
+            let idx = img.func_index(name.as_bytes()).unwrap();
+            assert_eq!(img.name(img.main_funcs()[idx].name), name.as_bytes());
+        }
+        assert_eq!(img.func_index(b"missing"), None);
+    }
+
+    #[test]
+    fn every_function_is_found_by_name() {
+        let spec: String = (0..500).map(|i| format!("f{}: func(a: u32) -> u32\n", i)).collect();
+        let wit = WIT::new(&spec, None).unwrap();
+        let img = wit.image.view();
+        assert_eq!(img.main_funcs().len(), 500);
+        for (i, f) in img.main_funcs().iter().enumerate() {
+            assert_eq!(img.func_index(img.name(f.name)), Some(i));
+        }
+        assert_eq!(img.func_index(b"f500"), None);
+    }
+
+    #[test]
+    fn damaged_images_are_rejected() {
+        let wit = WIT::new(SPEC, None).unwrap();
+        let bytes = wit.image.bytes();
+        let img = wit.image.view();
+        let damage = |at: usize, val: u32| {
+            let mut copy = bytes.to_vec();
+            copy[at..at + 4].copy_from_slice(&val.to_ne_bytes());
+            load_err(&copy)
+        };
+        let format = Some(WITErrorCode::Format);
+        assert_eq!(load_err(&bytes[..bytes.len() - 8]), format);
+        assert_eq!(damage(0, 0), format);
+
+        // A type of no kind, and a typedef of a type that isn't there.
+        let types = img.header().sections[SEC_TYPES].offset as usize;
+        let typedefs = img.header().sections[SEC_TYPEDEFS].offset as usize;
+        assert_eq!(damage(types, 999), format);
+        assert_eq!(damage(typedefs + 8, u32::MAX), format);
+
+        // An alias of itself, which still resolves to where it did.
+        let pt = img.types().iter().position(|t| img.name(t.name) == b"pt").unwrap();
+        let elem = types + pt * size_of::<TypeRec>() + 28;
+        assert_eq!(damage(elem, pt as u32), format);
+    }
+
+    #[test]
+    fn shared_types_are_merged() {
+        let a = "\
+record point {
+    x: s32,
+    y: s32,
+}
+
+f: func(p: point) -> point
+";
+        let b = "\
+record point {
+    x: s32,
+    y: s32,
+}
+
+record segment {
+    from: point,
+    to: point,
+}
+
+g: func(s: segment) -> point
+";
+        let wit = WIT::new_interfaces(&[("a", a), ("b", b)], 0, None).unwrap();
+        validate(wit.image.bytes()).unwrap();
+        let img = wit.image.view();
+        assert_eq!(img.types().iter().filter(|t| img.name(t.name) == b"point").count(), 1);
+        let f = &img.iface_funcs(&img.interfaces()[0])[0];
+        let g = &img.iface_funcs(&img.interfaces()[1])[0];
+        assert_eq!(f.result, g.result);
+        let segment = img.ty(img.typedefs()[g.param_first as usize].ty);
+        assert!(img.members(segment).iter().all(|m| m.ty == f.result));
+    }
+}
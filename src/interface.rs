@@ -0,0 +1,246 @@
+// WITs of several interfaces.
+//
+// `wit_parse_interfaces` parses a set of documents, one interface each,
+// into a single image.  Types that come out structurally identical in
+// different interfaces -- a record both declare, `list<string>` and the
+// like -- are kept once in the shared type table, so typedefs of either
+// compare, fingerprint and lay out as the same type.  Each interface has
+// its own run of the function table and of the name index.
+//
+// Calls on the WIT as a whole (`wit_func_get_by_name`, `wit_diff`,
+// `wit_layout_compile`, ...) see the first interface; the others are
+// reached through `wit_interface_get_by_name`.
+
+use libc::c_char;
+use std::collections::HashSet;
+use std::ffi::CStr;
+use std::slice;
+use std::str;
+
+use crate::{Record, WIT, WITFunction, WITSession, record, utf8};
+use crate::alloc::{Allocator, hooks_of, new_handle};
+use crate::error::{Result, WITErr, check};
+use crate::image::{SOURCE_HASH_START, source_hash_more};
+#[cfg(feature="catch_panics")]
+use crate::error::{WITErrorCode, error_set};
+#[cfg(feature="catch_panics")]
+use std::panic::{catch_unwind, AssertUnwindSafe};
+
+#[derive(Default)]
+#[repr(C)]
+pub struct WITInterface {
+    pub(crate) base:       u32,     // Byte offset of this record in its image
+    pub(crate) name:       u32,
+    pub(crate) func_first: u32,     // Functions are a run of the function table
+    pub(crate) func_count: u32,
+    pub(crate) seed_first: u32,     // Name index seeds and slots are runs too
+    pub(crate) seed_count: u32,
+    pub(crate) slot_first: u32,
+    pub(crate) slot_count: u32,
+}
+impl Record for WITInterface {
+    fn base(&self) -> u32 { self.base }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Parses `n` documents into one WIT, each as the interface named
+// `names[i]`.  Names must be distinct.  The WIT's hash covers every name
+// and document, in order.
+#[no_mangle]
+pub extern "C" fn wit_parse_interfaces(s: *mut WITSession, names: *const *const c_char, contents: *const *const u8, lens: *const usize, n: usize, res: *mut *mut WIT) -> bool {
+    ffi_return!(s, _wit_parse_interfaces(hooks_of(s), names, contents, lens, n, res))
+}
+fn _wit_parse_interfaces(alloc: Option<Allocator>, names: *const *const c_char, contents: *const *const u8, lens: *const usize, n: usize, res: *mut *mut WIT) -> Result<()> {
+    if n == 0 || names.is_null() || contents.is_null() || lens.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let (names, contents, lens) = unsafe {
+        (slice::from_raw_parts(names, n), slice::from_raw_parts(contents, n), slice::from_raw_parts(lens, n))
+    };
+    if names.iter().any(|p| p.is_null()) || contents.iter().any(|c| c.is_null()) {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let mut docs = Vec::with_capacity(n);
+    let mut seen = HashSet::with_capacity(n);
+    let mut hash = SOURCE_HASH_START;
+    for ((name, content), len) in names.iter().zip(contents).zip(lens) {
+        let (name, content) = unsafe {
+            (CStr::from_ptr(*name).to_bytes(), slice::from_raw_parts(*content, *len))
+        };
+        if !seen.insert(name) {
+            return Err(wit_err!(InvalidArgument, "Duplicate interface name"))
+        }
+        // The terminators keep one document's name or text from running
+        // into the next.
+        for part in [name, &[0], content, &[0]] {
+            hash = source_hash_more(hash, part);
+        }
+        // A bad name is a bad argument; only bad text is a parse error.
+        let name = str::from_utf8(name)
+            .map_err(|_| wit_err!(InvalidArgument, "Invalid argument; interface names must be UTF-8"))?;
+        docs.push((name, utf8(content)?));
+    }
+    let safe_res = new_handle(alloc, WIT::new_interfaces(&docs, hash, alloc)?)?;
+    unsafe {
+        *res = safe_res;
+    }
+    Ok(())
+}
+
+// Gets the number of interfaces, which is 1 unless the WIT came from
+// `wit_parse_interfaces`.
+#[no_mangle]
+pub extern "C" fn wit_interface_count_get(s: *mut WITSession, wit: *const WIT, res: *mut usize) -> bool {
+    ffi_return!(s, _wit_interface_count_get(wit, res))
+}
+fn _wit_interface_count_get(wit: *const WIT, res: *mut usize) -> Result<()> {
+    if wit.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let wit = unsafe {
+        &*wit
+    };
+    unsafe {
+        *res = wit.image.view().interfaces().len();
+    }
+    Ok(())
+}
+
+#[no_mangle]
+pub extern "C" fn wit_interface_get_by_index(s: *mut WITSession, wit: *const WIT, index: usize, res: *mut *const WITInterface) -> bool {
+    ffi_return!(s, _wit_interface_get_by_index(wit, index, res))
+}
+fn _wit_interface_get_by_index(wit: *const WIT, index: usize, res: *mut *const WITInterface) -> Result<()> {
+    if wit.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let wit = unsafe {
+        &*wit
+    };
+    let img = wit.image.view();
+    if let Some(iface) = img.interfaces().get(index) {
+        unsafe {
+            *res = img.handle(iface);
+        }
+        Ok(())
+    } else {
+        Err(wit_err!(OutOfBounds, "Interface index out of bounds"))
+    }
+}
+
+// Interfaces are few, so this is a plain scan.
+#[no_mangle]
+pub extern "C" fn wit_interface_get_by_name(s: *mut WITSession, wit: *const WIT, name: *const c_char, res: *mut *const WITInterface) -> bool {
+    ffi_return!(s, _wit_interface_get_by_name(wit, name, res))
+}
+fn _wit_interface_get_by_name(wit: *const WIT, name: *const c_char, res: *mut *const WITInterface) -> Result<()> {
+    if wit.is_null() || name.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let (wit, name) = unsafe {
+        (&*wit, CStr::from_ptr(name).to_bytes())
+    };
+    let img = wit.image.view();
+    if let Some(iface) = img.interfaces().iter().find(|i| img.name(i.name) == name) {
+        unsafe {
+            *res = img.handle(iface);
+        }
+        Ok(())
+    } else {
+        Err(wit_err!(NotFound, "Interface not found"))
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn wit_interface_name_get(s: *mut WITSession, iface: *const WITInterface, res: *mut *const c_char) -> bool {
+    ffi_return!(s, _wit_interface_name_get(iface, res))
+}
+fn _wit_interface_name_get(iface: *const WITInterface, res: *mut *const c_char) -> Result<()> {
+    if iface.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let (img, iface) = unsafe {
+        record(iface)
+    };
+    unsafe {
+        *res = img.name_ptr(iface.name);
+    }
+    Ok(())
+}
+
+#[no_mangle]
+pub extern "C" fn wit_interface_func_count_get(s: *mut WITSession, iface: *const WITInterface, res: *mut usize) -> bool {
+    ffi_return!(s, _wit_interface_func_count_get(iface, res))
+}
+fn _wit_interface_func_count_get(iface: *const WITInterface, res: *mut usize) -> Result<()> {
+    if iface.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let iface = unsafe {
+        &*iface
+    };
+    unsafe {
+        *res = iface.func_count as usize;
+    }
+    Ok(())
+}
+
+#[no_mangle]
+pub extern "C" fn wit_interface_func_get_by_index(s: *mut WITSession, iface: *const WITInterface, index: usize, res: *mut *const WITFunction) -> bool {
+    ffi_return!(s, _wit_interface_func_get_by_index(iface, index, res))
+}
+fn _wit_interface_func_get_by_index(iface: *const WITInterface, index: usize, res: *mut *const WITFunction) -> Result<()> {
+    if iface.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let (img, iface) = unsafe {
+        record(iface)
+    };
+    if let Some(func) = img.iface_funcs(iface).get(index) {
+        unsafe {
+            *res = img.handle(func);
+        }
+        Ok(())
+    } else {
+        Err(wit_err!(OutOfBounds, "Function index out of bounds"))
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn wit_interface_func_get_by_name(s: *mut WITSession, iface: *const WITInterface, fname: *const c_char, res: *mut *const WITFunction) -> bool {
+    ffi_return!(s, _wit_interface_func_get_by_name(iface, fname, res))
+}
+fn _wit_interface_func_get_by_name(iface: *const WITInterface, fname: *const c_char, res: *mut *const WITFunction) -> Result<()> {
+    if iface.is_null() || fname.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let ((img, iface), fname) = unsafe {
+        (record(iface), CStr::from_ptr(fname).to_bytes())
+    };
+    if let Some(idx) = img.iface_func_index(iface, fname) {
+        unsafe {
+            *res = img.handle(&img.iface_funcs(iface)[idx]);
+        }
+        Ok(())
+    } else {
+        Err(WITErr::func_not_found(fname))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::error::WITErrorCode;
+
+    #[test]
+    fn non_utf8_name_is_invalid_argument() {
+        let names = [b"ok\0".as_ptr() as *const c_char, b"\xff\0".as_ptr() as *const c_char];
+        let contents = [b"".as_ptr(), b"".as_ptr()];
+        let lens = [0usize, 0];
+        let mut wit = std::ptr::null_mut();
+        let res = _wit_parse_interfaces(None, names.as_ptr(), contents.as_ptr(), lens.as_ptr(), 2, &mut wit);
+        assert_eq!(res.err().map(|e| e.code()), Some(WITErrorCode::InvalidArgument));
+        assert!(wit.is_null());
+    }
+}
@@ -0,0 +1,232 @@
+// Compiled layouts: a flat, read-only snapshot of every function's ABI
+// layout, so C/C++ callers can walk a signature with plain pointer
+// arithmetic instead of one FFI call per node.
+
+use libc::c_char;
+
+use crate::{ImageRef, WIT, WITSession, WITType};
+use crate::error::{Result, check};
+use crate::alloc::{Allocator, delete_handle, hooks_of, new_handle};
+#[cfg(feature="catch_panics")]
+use crate::{WITErr, WITErrorCode, error_set};
+#[cfg(feature="catch_panics")]
+use std::panic::{catch_unwind, AssertUnwindSafe};
+
+// A single type in a compiled layout.  Nodes are stored in one contiguous
+// array; the children of a node (record fields, variant cases, list
+// element, aliased type, ...) always occupy the contiguous range
+// `[child_begin, child_begin + child_count)` of that array.
+#[repr(C)]
+pub struct WITLayoutNode {
+    pub kind:        WITType,
+    pub size:        usize,
+    pub align:       usize,
+    pub offset:      usize,     // Byte offset within the parent
+    pub child_begin: usize,     // Index of the first child node
+    pub child_count: usize,
+    pub name:        usize,     // Offset of the name in the string pool
+}
+
+// A function in a compiled layout.  Its parameters are the nodes
+// `[param_begin, param_begin + param_count)`, and its result is the node
+// `result`.
+#[repr(C)]
+pub struct WITLayoutFunc {
+    pub name:        usize,     // Offset of the name in the string pool
+    pub param_begin: usize,
+    pub param_count: usize,
+    pub result:      usize,
+}
+
+pub struct WITLayout {
+    nodes: Vec<WITLayoutNode>,
+    funcs: Vec<WITLayoutFunc>,
+    names: Vec<u8>,             // NUL-terminated names, back to back
+}
+
+struct LayoutBuilder<'a> {
+    img:   ImageRef<'a>,
+    nodes: Vec<WITLayoutNode>,
+}
+
+impl<'a> LayoutBuilder<'a> {
+    // Appends `count` placeholder nodes, returning the index of the first.
+    fn reserve(&mut self, count: usize) -> usize {
+        let begin = self.nodes.len();
+        for _ in 0..count {
+            self.nodes.push(
+                WITLayoutNode {
+                    kind:        WITType::Unit,
+                    size:        0,
+                    align:       1,
+                    offset:      0,
+                    child_begin: 0,
+                    child_count: 0,
+                    name:        0,
+                }
+            );
+        }
+        begin
+    }
+
+    // Returns (name, type, offset) for each child of the given type.
+    fn children(&self, ty: u32) -> Vec<(u32, u32, u32)> {
+        let rec = self.img.ty(ty);
+        match rec.kind() {
+            WITType::Record |
+            WITType::Tuple |
+            WITType::Variant |
+            WITType::Union |
+            WITType::Option |
+            WITType::Expected => {
+                self.img.members(rec).iter()
+                    .map(|m| (m.name, m.ty, m.offset))
+                    .collect()
+            },
+            WITType::List |
+            WITType::Type => vec![(0, rec.elem, 0)],
+            _ => Vec::new(),
+        }
+    }
+
+    // Fills in the placeholder node at `idx`, then lays out its children.
+    fn fill(&mut self, idx: usize, name: u32, ty: u32, offset: u32) {
+        let rec = self.img.ty(ty);
+        let children = self.children(ty);
+        let child_begin = self.reserve(children.len());
+        self.nodes[idx] =
+            WITLayoutNode {
+                kind:        rec.kind(),
+                size:        rec.size as usize,
+                align:       rec.align as usize,
+                offset:      offset as usize,
+                child_begin,
+                child_count: children.len(),
+                name:        name as usize,
+            };
+        for (i, (cname, cty, coff)) in children.into_iter().enumerate() {
+            self.fill(child_begin + i, cname, cty, coff);
+        }
+    }
+}
+
+impl WITLayout {
+    fn new(wit: &WIT) -> WITLayout {
+        let img = wit.image.view();
+        let mut b = LayoutBuilder {
+            img,
+            nodes: Vec::new(),
+        };
+        let mut funcs = Vec::with_capacity(img.main_funcs().len());
+        for func in img.main_funcs() {
+            // Params and the result occupy one contiguous block.
+            let params = &img.typedefs()[func.param_first as usize..][..func.param_count as usize];
+            let param_count = params.len();
+            let param_begin = b.reserve(param_count + 1);
+            for (i, p) in params.iter().enumerate() {
+                b.fill(param_begin + i, p.name, p.ty, 0);
+            }
+            let result = param_begin + param_count;
+            b.fill(result, 0, func.result, 0);
+            funcs.push(
+                WITLayoutFunc {
+                    name: func.name as usize,
+                    param_begin,
+                    param_count,
+                    result,
+                }
+            );
+        }
+        WITLayout {
+            nodes: b.nodes,
+            funcs,
+            // Names are offsets into the spec's own string pool.
+            names: img.names().to_vec(),
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+#[no_mangle]
+pub extern "C" fn wit_layout_compile(s: *mut WITSession, wit: *const WIT, res: *mut *mut WITLayout) -> bool {
+    ffi_return!(s, _wit_layout_compile(hooks_of(s), wit, res))
+}
+fn _wit_layout_compile(alloc: Option<Allocator>, wit: *const WIT, res: *mut *mut WITLayout) -> Result<()> {
+    if wit.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let wit = unsafe {
+        &*wit
+    };
+    let safe_res = new_handle(alloc, WITLayout::new(wit))?;
+    unsafe {
+        *res = safe_res;
+    }
+    Ok(())
+}
+
+#[no_mangle]
+pub extern "C" fn wit_layout_delete(_s: *mut WITSession, layout: *mut WITLayout) {
+    if layout.is_null() {
+        return;
+    }
+    unsafe {
+        delete_handle(layout);
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn wit_layout_nodes_get(s: *mut WITSession, layout: *const WITLayout, res: *mut *const WITLayoutNode, len: *mut usize) -> bool {
+    ffi_return!(s, _wit_layout_nodes_get(layout, res, len))
+}
+fn _wit_layout_nodes_get(layout: *const WITLayout, res: *mut *const WITLayoutNode, len: *mut usize) -> Result<()> {
+    if layout.is_null() || res.is_null() || len.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let layout = unsafe {
+        &*layout
+    };
+    unsafe {
+        *res = layout.nodes.as_ptr();
+        *len = layout.nodes.len();
+    }
+    Ok(())
+}
+
+#[no_mangle]
+pub extern "C" fn wit_layout_funcs_get(s: *mut WITSession, layout: *const WITLayout, res: *mut *const WITLayoutFunc, len: *mut usize) -> bool {
+    ffi_return!(s, _wit_layout_funcs_get(layout, res, len))
+}
+fn _wit_layout_funcs_get(layout: *const WITLayout, res: *mut *const WITLayoutFunc, len: *mut usize) -> Result<()> {
+    if layout.is_null() || res.is_null() || len.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let layout = unsafe {
+        &*layout
+    };
+    unsafe {
+        *res = layout.funcs.as_ptr();
+        *len = layout.funcs.len();
+    }
+    Ok(())
+}
+
+// Returns the base of the string pool.  A node's or function's name is
+// the NUL-terminated string at `names + name`.
+#[no_mangle]
+pub extern "C" fn wit_layout_names_get(s: *mut WITSession, layout: *const WITLayout, res: *mut *const c_char) -> bool {
+    ffi_return!(s, _wit_layout_names_get(layout, res))
+}
+fn _wit_layout_names_get(layout: *const WITLayout, res: *mut *const c_char) -> Result<()> {
+    if layout.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let layout = unsafe {
+        &*layout
+    };
+    unsafe {
+        *res = layout.names.as_ptr() as *const c_char;
+    }
+    Ok(())
+}
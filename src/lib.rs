@@ -1,23 +1,98 @@
 extern crate libc;
 
-use anyhow::{anyhow, Result};
 use core::slice;
-use core::slice::Iter;
 use core::iter::Iterator;
 use libc::c_char;
-use std::collections::HashMap;
-use std::ffi::{CStr, CString};
+use std::ffi::CStr;
+use std::marker::PhantomData;
 use std::ptr;
-use std::rc::Rc;
 use std::str;
-use parser::TypeDefKind;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::thread;
 use parser::abi;
-use parser::{Interface, Int, Case, Field, Type, SizeAlign};
+use parser::Interface;
 
+use std::panic::{catch_unwind, AssertUnwindSafe};
+
+// Instrumentation, which compiles to nothing without the `stats`
+// feature.  `stat_add!` adds to one of the `WITStats` counters, and
+// `stat_time!` adds the time taken by an expression.
+#[cfg(feature="stats")]
+macro_rules! stat_add {
+    ($field: ident, $n: expr) => {
+        crate::stats::add(|st| st.$field += $n as u64)
+    }
+}
+#[cfg(not(feature="stats"))]
+macro_rules! stat_add {
+    ($field: ident, $n: expr) => {}
+}
+
+#[cfg(feature="stats")]
+macro_rules! stat_time {
+    ($field: ident, $e: expr) => {{
+        let start = std::time::Instant::now();
+        let res = $e;
+        stat_add!($field, start.elapsed().as_nanos());
+        res
+    }}
+}
+#[cfg(not(feature="stats"))]
+macro_rules! stat_time {
+    ($field: ident, $e: expr) => {
+        $e
+    }
+}
+
+// Hands a worker thread's counts to the thread that started it.
+#[cfg(feature="stats")]
+macro_rules! stat_take {
+    () => {
+        crate::stats::take()
+    }
+}
+#[cfg(not(feature="stats"))]
+macro_rules! stat_take {
+    () => { () }
+}
+
+#[cfg(feature="stats")]
+macro_rules! stat_merge {
+    ($st: expr) => {
+        crate::stats::merge($st)
+    }
+}
+#[cfg(not(feature="stats"))]
+macro_rules! stat_merge {
+    ($st: expr) => {{
+        let () = $st;
+    }}
+}
+
+// Credits the counts of the call just made to the session it was made on.
+#[cfg(feature="stats")]
+macro_rules! stat_flush {
+    ($s: expr) => {
+        crate::stats::flush($s)
+    }
+}
+#[cfg(not(feature="stats"))]
+macro_rules! stat_flush {
+    ($s: expr) => {}
+}
+
+#[macro_use]
+mod error;
+use error::{ErrorSlot, Result, WITErr, check};
+mod alloc;
+use alloc::{Allocator, delete_handle, hooks_of, new_handle};
+pub use alloc::{WITAllocFn, WITFreeFn};
 #[cfg(feature="catch_panics")]
-use std::panic::catch_unwind;
+use error::error_set;
+pub use error::WITErrorCode;
 
 #[allow(non_camel_case_types)]
+#[derive(Clone, Copy, PartialEq)]
 #[repr(C)]
 pub enum WASMType {
     I32,
@@ -37,81 +112,262 @@ impl From<abi::WasmType> for WASMType {
 }
 
 pub struct WITSession {
-    error: Option<WITError>,
+    error: ErrorSlot,
+    alloc: Option<Allocator>,
+    #[cfg(feature="stats")]
+    stats: WITStats,
 }
 
 pub struct WIT {
-    iface: Rc<Interface>,
-    funcs: HashMap<String, WITFunction>,    // Function name to index
-    align: Rc<SizeAlign>
-}
-impl<'a> WIT {
-    fn new(wit: &str) -> Result<WIT> {
-        let iface = Rc::new(Interface::parse("wit", &wit)?);
-        let mut align = SizeAlign::default();
-        align.fill(&iface);
+    image: Image,
+}
+impl WIT {
+    fn new(wit: &str, alloc: Option<Allocator>) -> Result<WIT> {
+        WIT::new_hashed(wit, image::source_hash(wit.as_bytes()), alloc)
+    }
+
+    // Like `new`, for a caller that has already hashed the source.
+    fn new_hashed(wit: &str, hash: u64, alloc: Option<Allocator>) -> Result<WIT> {
+        stat_add!(parses, 1);
+        let iface = stat_time!(parse_ns, Interface::parse("wit", &wit))
+            .map_err(|e| WITErr::wrap(WITErrorCode::Parse, e))?;
         Ok(
-            WIT { 
-                iface,
-                funcs: HashMap::new(),
-                align: Rc::new(align)
+            WIT {
+                image: image::compile(slice::from_ref(&iface), hash, alloc)?,
+            }
+        )
+    }
+
+    // Parses each of `docs` as an interface with the given name, into one
+    // image.
+    fn new_interfaces(docs: &[(&str, &str)], hash: u64, alloc: Option<Allocator>) -> Result<WIT> {
+        stat_add!(parses, docs.len());
+        let ifaces = docs.iter()
+            .map(|(name, wit)| stat_time!(parse_ns, Interface::parse(name, wit))
+                .map_err(|e| WITErr::wrap(WITErrorCode::Parse, e)))
+            .collect::<Result<Vec<_>>>()?;
+        Ok(
+            WIT {
+                image: image::compile(&ifaces, hash, alloc)?,
             }
         )
     }
 }
 
 #[allow(non_camel_case_types)]
+#[derive(Clone, Copy, PartialEq)]
 #[repr(C)]
 pub enum WITSigPart {
     Params,
     Results,
 }
 
+// Which side of the boundary a signature is for: a function the guest
+// exports, or one it imports from the host.
+#[derive(Clone, Copy, PartialEq)]
+#[repr(C)]
+pub enum WITAbiVariant {
+    GuestExport,
+    GuestImport,
+}
+
+// A function's flattened core-wasm signature.  Each part is a contiguous
+// run of the image's WASM types.
+#[derive(Default)]
+#[repr(C)]
 pub struct WITSignature {
-    sig: abi::WasmSignature,
+    pub(crate) base:            u32,    // Byte offset of this record in its image
+    pub(crate) params:          u32,
+    pub(crate) params_len:      u32,
+    pub(crate) results:         u32,
+    pub(crate) results_len:     u32,
+    pub(crate) indirect_params: u32,
+    pub(crate) retptr:          u32,
+}
+impl WITSignature {
+    fn part<'a>(&self, img: ImageRef<'a>, part: WITSigPart) -> &'a [WASMType] {
+        let (first, len) = match part {
+            WITSigPart::Params  => (self.params, self.params_len),
+            WITSigPart::Results => (self.results, self.results_len),
+        };
+        &img.wasm()[first as usize..(first + len) as usize]
+    }
 }
 
+#[derive(Default)]
+#[repr(C)]
 pub struct WITFunction {
-    iface: Rc<Interface>,
-    align: Rc<SizeAlign>,
-    name:  CString,
-    sig:   WITSignature,
-    index: usize,  // function index
-    res:   WITTypeDef,
+    pub(crate) base:        u32,        // Byte offset of this record in its image
+    pub(crate) name:        u32,
+    pub(crate) param_first: u32,        // Params are a run of typedefs
+    pub(crate) param_count: u32,
+    pub(crate) result:      u32,        // Result type
+    pub(crate) plan_first:  u32,        // Call plan is a run of steps, or `NO_PLAN`
+    pub(crate) plan_count:  u32,
+    pub(crate) sigs:        [WITSignature; 2],  // By `WITAbiVariant`
+}
+impl WITFunction {
+    fn params<'a>(&self, img: ImageRef<'a>) -> &'a [WITTypeDef] {
+        let first = self.param_first as usize;
+        &img.typedefs()[first..first + self.param_count as usize]
+    }
+
+    fn sig(&self, variant: WITAbiVariant) -> &WITSignature {
+        &self.sigs[variant as usize]
+    }
+
+    fn plan<'a>(&self, img: ImageRef<'a>) -> Option<&'a [WITPlanStep]> {
+        if self.plan_first == plan::NO_PLAN {
+            return None;
+        }
+        let first = self.plan_first as usize;
+        Some(&img.steps()[first..first + self.plan_count as usize])
+    }
 }
 
+// Parsed specs, and everything handed out from them, may be shared
+// across threads.
+const _: fn() = || {
+    fn is_send_sync<T: Send + Sync>() {}
+    is_send_sync::<WIT>();
+    is_send_sync::<WITFunction>();
+    is_send_sync::<WITSignature>();
+    is_send_sync::<WITTypeDef>();
+    is_send_sync::<WITLayout>();
+};
+
+// A walk over a run of typedefs.  It keeps the pointers it will hand out,
+// made by `ImageRef::handle`, rather than references to the run.
+struct Run<'a> {
+    at:      *const WITTypeDef,
+    end:     *const WITTypeDef,
+    _image:  PhantomData<&'a WITTypeDef>,
+}
+impl<'a> Run<'a> {
+    fn new(img: ImageRef<'a>, run: &'a [WITTypeDef]) -> Run<'a> {
+        let range = run.as_ptr_range();
+        Run { at: img.handle(range.start), end: img.handle(range.end), _image: PhantomData }
+    }
+
+    fn item(&self) -> Option<*const WITTypeDef> {
+        if self.at == self.end { None } else { Some(self.at) }
+    }
+
+    fn next(&mut self) {
+        self.at = unsafe { self.at.add(1) };
+    }
+}
+
+// Like the image it walks, a run is only read.
+unsafe impl Send for Run<'_> {}
+unsafe impl Sync for Run<'_> {}
+
 pub struct WITTypeDefIter<'a> {
-    iface:       Rc<Interface>,
-    align:       Rc<SizeAlign>,
-    inner_iter:  Iter<'a, (String, Type)>,
-    item:        Option<WITTypeDef>
+    run:  Run<'a>,
 }
 
 pub struct WITFieldIter<'a> {
-    iface:       Rc<Interface>,
-    align:       Rc<SizeAlign>,
-    inner_iter:  Iter<'a, Field>,
-    item:        Option<WITTypeDef>
+    run:  Run<'a>,
 }
 
 pub struct WITCaseIter<'a> {
-    iface:       Rc<Interface>,
-    align:       Rc<SizeAlign>,
-    inner_iter:  Iter<'a, Case>,
-    item:        Option<WITTypeDef>
+    run:  Run<'a>,
 }
 
+// Caller-owned room for one iterator, e.g. on the stack, for the `*_walk_in`
+// calls.  An iterator built in it needs no `*_iter_delete`; it is done with
+// once the storage is reused or goes away.
+#[repr(C)]
+pub struct WITIterStorage {
+    opaque: [usize; 4],
+}
+
+const _: () = {
+    use std::mem::{align_of, size_of};
+    assert!(size_of::<WITTypeDefIter>() <= size_of::<WITIterStorage>());
+    assert!(size_of::<WITFieldIter>() <= size_of::<WITIterStorage>());
+    assert!(size_of::<WITCaseIter>() <= size_of::<WITIterStorage>());
+    assert!(align_of::<WITTypeDefIter>() <= align_of::<WITIterStorage>());
+    assert!(align_of::<WITFieldIter>() <= align_of::<WITIterStorage>());
+    assert!(align_of::<WITCaseIter>() <= align_of::<WITIterStorage>());
+};
+
+// Puts an iterator in caller-owned storage.  None of the iterators need
+// dropping, so the storage can simply be abandoned.
+fn iter_in<T>(storage: *mut WITIterStorage, iter: T) -> *mut T {
+    let storage = storage as *mut T;
+    unsafe {
+        ptr::write(storage, iter);
+    }
+    storage
+}
+
+// A type as seen from one place it is used: a param, a field, a case, or
+// (unnamed, at offset 0) the type itself.  Every use of a type shares the
+// type's one table entry, and every type has exactly one unnamed typedef.
+#[derive(Default)]
+#[repr(C)]
 pub struct WITTypeDef {
-    iface:       Rc<Interface>,
-    align:       Rc<SizeAlign>,
-    name:        CString,
-    ty:          Type,
-    subty1:      Option<Box<WITTypeDef>>,
-    subty2:      Option<Box<WITTypeDef>>,
+    pub(crate) base:   u32,     // Byte offset of this record in its image
+    pub(crate) name:   u32,
+    pub(crate) ty:     u32,     // Index into the type table
+    pub(crate) offset: u32,     // Byte offset within the enclosing type
+}
+impl WITTypeDef {
+    fn rec<'a>(&self, img: ImageRef<'a>) -> &'a TypeRec {
+        img.ty(self.ty)
+    }
+
+    fn kind(&self, img: ImageRef) -> WITType {
+        self.rec(img).kind()
+    }
+
+    // Members (fields, cases, ...) of the type.
+    fn members<'a>(&self, img: ImageRef<'a>) -> &'a [WITTypeDef] {
+        img.members(img.ty(self.ty))
+    }
+
+    // The unnamed typedef of a list's element or an alias's target.
+    fn elem<'a>(&self, img: ImageRef<'a>) -> &'a WITTypeDef {
+        img.typedef(img.ty(self.ty).elem)
+    }
+
+    // The first typedef down an alias chain that isn't an alias, or this
+    // one if it isn't.
+    fn resolved<'a>(&'a self, img: ImageRef<'a>) -> &'a WITTypeDef {
+        if self.kind(img) == WITType::Type {
+            img.typedef(self.rec(img).resolved)
+        } else {
+            self
+        }
+    }
+}
+
+// The records handed out over the FFI, each of which knows where it is in
+// its image.
+pub(crate) trait Record {
+    fn base(&self) -> u32;
+}
+impl Record for WITSignature {
+    fn base(&self) -> u32 { self.base }
+}
+impl Record for WITFunction {
+    fn base(&self) -> u32 { self.base }
+}
+impl Record for WITTypeDef {
+    fn base(&self) -> u32 { self.base }
+}
+
+// The image a record passed in over the FFI lives in, and the record.
+//
+// Safety: `rec` must be non-NULL and handed out by `ImageRef::handle`.
+pub(crate) unsafe fn record<'a, T: Record>(rec: *const T) -> (ImageRef<'a>, &'a T) {
+    let r = &*rec;
+    (ImageRef::of(rec, r.base()), r)
 }
 
 #[allow(non_camel_case_types)]
-#[derive(PartialEq)]
+#[derive(PartialEq, Clone, Copy)]
 #[repr(C)]
 pub enum WITType {
     Unit,
@@ -141,9 +397,19 @@ pub enum WITType {
     Type,
     Stream,
 }
-
-pub struct WITError {
-    c_msg: CString
+impl WITType {
+    fn from_u32(v: u32) -> Option<WITType> {
+        const ALL: [WITType; WITType::Stream as usize + 1] = [
+            WITType::Unit, WITType::Bool, WITType::U8, WITType::U16,
+            WITType::U32, WITType::U64, WITType::S8, WITType::S16,
+            WITType::S32, WITType::S64, WITType::Float32, WITType::Float64,
+            WITType::Char, WITType::String, WITType::Flags, WITType::Record,
+            WITType::List, WITType::Variant, WITType::Tuple, WITType::Enum,
+            WITType::Expected, WITType::Option, WITType::Union, WITType::Handle,
+            WITType::Type, WITType::Stream,
+        ];
+        ALL.get(v as usize).copied()
+    }
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -151,13 +417,16 @@ pub struct WITError {
 #[cfg(feature="catch_panics")]
 macro_rules! ffi_return {
     ($s: expr, $e:expr) => {{
-        let res = catch_unwind(|| {
+        // Error slots live behind cells, which aren't unwind-safe by
+        // default.  A caught panic is reported as an error either way.
+        let res = catch_unwind(AssertUnwindSafe(|| {
             check($s, $e)
-        });
+        }));
+        stat_flush!($s);
         match res {
             Ok(r) => r,
             Err(e) => {
-                error_set(unsafe { &mut *$s }, anyhow!("Caught Rust panic: {:?}", e));
+                error_set($s, WITErr::wrap(WITErrorCode::Panic, anyhow::anyhow!("Caught Rust panic: {:?}", e)));
                 false
             },
         }
@@ -165,71 +434,68 @@ macro_rules! ffi_return {
 }
 #[cfg(not(feature="catch_panics"))]
 macro_rules! ffi_return {
-    ($s: expr, $e:expr) => {
-        check($s, $e)
-    }
+    ($s: expr, $e:expr) => {{
+        let res = check($s, $e);
+        stat_flush!($s);
+        res
+    }}
 }
 
+// Submodules come after `ffi_return!` so they can use it.
+mod image;
+#[cfg(unix)]
+mod mapping;
+use image::{Image, ImageRef, TypeRec};
+pub use image::{wit_serialize, wit_load, wit_load_borrowed, wit_hash_get, wit_source_hash};
+#[cfg(unix)]
+pub use image::wit_load_mmap;
+mod layout;
+pub use layout::{WITLayout, WITLayoutNode, WITLayoutFunc};
+mod plan;
+pub use plan::{WITPlanLoc, WITPlanOp, WITPlanStep};
+mod fingerprint;
+mod codegen;
+mod marshal;
+mod transcode;
+mod diff;
+pub use diff::{WITChange, WITDiff, WITDiffEntry};
+mod stream;
+pub use stream::WITParser;
+mod interface;
+pub use interface::WITInterface;
+mod background;
+pub use background::{WITCancel, WITParseCallback};
+#[cfg(feature="stats")]
+mod stats;
+#[cfg(feature="stats")]
+pub use stats::{WITStats, wit_session_stats_get, wit_session_stats_clear};
+
 //////////////////////////////////////////////////////////////////////////
 
 #[no_mangle]
-pub extern "C" fn wit_error_get(s: *const WITSession) -> *const c_char {
-    if s.is_null() {
-        return ptr::null()
-    }
-    let s = unsafe { &*s };
-    match &s.error {
-        Some(e) => e.c_msg.as_ptr(),
-        _ => ptr::null()
-    }
+pub extern "C" fn wit_session_new() -> *mut WITSession {
+    session_new(None).unwrap_or(ptr::null_mut())
 }
 
+// Like `wit_session_new`, but everything the session hands back is
+// allocated with `alloc_fn` and freed with `free_fn`, each passed `ctx`.
+// Returns NULL if either hook is NULL, or the session can't be allocated.
 #[no_mangle]
-pub extern "C" fn wit_error_clear(s: *mut WITSession) {
-    if s.is_null() {
-        return;
+pub extern "C" fn wit_session_new_with_allocator(alloc_fn: WITAllocFn, free_fn: WITFreeFn, ctx: *mut libc::c_void) -> *mut WITSession {
+    match Allocator::new(alloc_fn, free_fn, ctx) {
+        Some(a) => session_new(Some(a)).unwrap_or(ptr::null_mut()),
+        None => ptr::null_mut(),
     }
-    let s = unsafe { &mut *s };
-    s.error.take();
 }
 
-fn error_set(s: &mut WITSession, err: anyhow::Error) -> bool { 
-    let err_res = CString::new(err.to_string());
-    match err_res {
-        Ok(msg) => 
-        {
-            s.error.replace(
-                WITError{ 
-                    c_msg: msg
-                }
-            );
-            true
-        },
-        Err(_) =>
-            false
-        }
-}
-
-// Checks the result for an error.  If present, sets the thread-local
-// error slot and returns false.  If no error, true is returned.
-fn check(s: *mut WITSession, r: Result<()>) -> bool {
-    if let Err(err) = r {
-        if !s.is_null() {
-            error_set(unsafe { &mut *s }, err);
-        }
-        false
-    } else {
-        true
-    }
-}
-
-#[no_mangle]
-pub extern "C" fn wit_session_new() -> *mut WITSession {
+fn session_new(alloc: Option<Allocator>) -> Result<*mut WITSession> {
     let s = WITSession {
-        error: None,
+        error: ErrorSlot::new(alloc),
+        alloc,
+        #[cfg(feature="stats")]
+        stats: WITStats::default(),
     };
-    let res = Box::new(s);
-    Box::leak(res)
+    new_handle(alloc, s)
 }
 
 #[no_mangle]
@@ -238,53 +504,170 @@ pub extern "C" fn wit_session_delete(s: *mut WITSession) {
         return;
     }
     unsafe {
-        Box::from_raw(s);
+        delete_handle(s);
     }
 }
 
 #[no_mangle]
 pub extern "C" fn wit_parse(s: *mut WITSession, content: *const u8, len: usize, res: *mut *mut WIT) -> bool {
-    ffi_return!(s, _wit_parse(content, len, res))
+    ffi_return!(s, _wit_parse(hooks_of(s), content, len, true, res))
+}
+
+// Like `wit_parse`, but skips checking that the content is valid UTF-8.
+// The caller must guarantee it is; passing anything else is undefined
+// behavior.
+#[no_mangle]
+pub extern "C" fn wit_parse_unchecked(s: *mut WITSession, content: *const u8, len: usize, res: *mut *mut WIT) -> bool {
+    ffi_return!(s, _wit_parse(hooks_of(s), content, len, false, res))
 }
-fn _wit_parse(content: *const u8, len: usize, res: *mut *mut WIT) -> Result<()> {
+fn _wit_parse(alloc: Option<Allocator>, content: *const u8, len: usize, check_utf8: bool, res: *mut *mut WIT) -> Result<()> {
     if content.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid arguments"))
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
     }
     let content = unsafe {
-        str::from_utf8(slice::from_raw_parts(content, len))?
+        slice::from_raw_parts(content, len)
     };
+    if check_utf8 {
+        wit_parse_str(utf8(content)?, alloc, res)
+    } else {
+        wit_parse_str(unsafe { str::from_utf8_unchecked(content) }, alloc, res)
+    }
+}
 
-    // Extract the WASM signature for each function.
-    let mut safe_res = WIT::new(content)?;
+// Parses the spec in a file, reading it in place from a mapping of the
+// file rather than a copy.  A missing file is `NotFound`; one that's
+// empty or isn't a regular file is `InvalidArgument`.
+#[cfg(unix)]
+#[no_mangle]
+pub extern "C" fn wit_parse_file(s: *mut WITSession, path: *const c_char, res: *mut *mut WIT) -> bool {
+    ffi_return!(s, _wit_parse_file(hooks_of(s), path, res))
+}
+#[cfg(unix)]
+fn _wit_parse_file(alloc: Option<Allocator>, path: *const c_char, res: *mut *mut WIT) -> Result<()> {
+    if path.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    // Nothing refers back to the source once parsed, so the mapping can
+    // go as soon as the parse is done.
+    let map = mapping::Mapping::open_c(path)?;
+    wit_parse_str(utf8(map.bytes())?, alloc, res)
+}
 
-    // Create a map of each function's name to its index into the interface.
-    let funcs = &safe_res.iface.functions;
-    for i in 0..funcs.len() {
-        let sig = WITSignature {
-            sig: safe_res.iface.wasm_signature(abi::AbiVariant::GuestExport, &funcs[i]),
+// Parses `n` specs at once, spread over `threads` worker threads (0 picks
+// one per CPU), or as many as can be started, or else the calling thread.
+// Each `out[i]` is set to the parsed spec, or to NULL if `contents[i]`
+// failed to parse, in which case `codes[i]`, if `codes` isn't NULL, says
+// why.  Returns false if any spec failed, with the session's error set to
+// that of the first one that did.
+#[no_mangle]
+pub extern "C" fn wit_parse_many(s: *mut WITSession, contents: *const *const u8, lens: *const usize, n: usize, out: *mut *mut WIT, codes: *mut WITErrorCode, threads: usize) -> bool {
+    ffi_return!(s, _wit_parse_many(hooks_of(s), contents, lens, n, out, codes, threads))
+}
+fn _wit_parse_many(alloc: Option<Allocator>, contents: *const *const u8, lens: *const usize, n: usize, out: *mut *mut WIT, codes: *mut WITErrorCode, threads: usize) -> Result<()> {
+    if n == 0 {
+        return Ok(())
+    }
+    if contents.is_null() || lens.is_null() || out.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let (contents, lens, out) = unsafe {
+        (slice::from_raw_parts(contents, n), slice::from_raw_parts(lens, n), slice::from_raw_parts_mut(out, n))
+    };
+    if contents.iter().any(|c| c.is_null()) {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let docs: Vec<&[u8]> = contents.iter().zip(lens)
+        .map(|(c, len)| unsafe { slice::from_raw_parts(*c, *len) })
+        .collect();
+
+    let threads = match threads {
+        0 => thread::available_parallelism().map(|n| n.get()).unwrap_or(1),
+        n => n,
+    }.min(n);
+    let next = AtomicUsize::new(0);
+    // Panics are caught per spec whatever the features, as one can't be
+    // let out of this call.
+    let work = || {
+        let mut done = Vec::new();
+        loop {
+            let i = next.fetch_add(1, Ordering::Relaxed);
+            if i >= docs.len() {
+                break (done, stat_take!());
+            }
+            let res = catch_unwind(AssertUnwindSafe(|| utf8(docs[i]).and_then(|doc| WIT::new(doc, alloc))))
+                .unwrap_or_else(|e| Err(WITErr::wrap(WITErrorCode::Panic, anyhow::anyhow!("Caught Rust panic: {:?}", e))));
+            done.push((i, res));
+        }
+    };
+    let mut results: Vec<Option<Result<WIT>>> = (0..n).map(|_| None).collect();
+    let mut lost = false;
+    thread::scope(|scope| {
+        // Workers that can't be started are done without; if none can,
+        // the specs are parsed on this thread.
+        let workers: Vec<_> = (0..threads)
+            .map_while(|_| thread::Builder::new().name("to-wit-parse".into()).spawn_scoped(scope, &work).ok())
+            .collect();
+        let mut finished = Vec::with_capacity(workers.len().max(1));
+        if workers.is_empty() {
+            finished.push(work());
+        }
+        for worker in workers {
+            match worker.join() {
+                Ok(res) => finished.push(res),
+                // Its specs are left without a result.
+                Err(_) => lost = true,
+            }
+        }
+        for (done, _stats) in finished {
+            stat_merge!(_stats);
+            for (i, res) in done {
+                results[i] = Some(res);
+            }
+        }
+    });
+
+    let mut first_err = None;
+    for (i, res) in results.into_iter().enumerate() {
+        let res = res.map(|r| r.and_then(|wit| new_handle(alloc, wit)));
+        let (wit, code) = match res {
+            Some(Ok(wit)) => (wit, WITErrorCode::None),
+            Some(Err(err)) => {
+                let code = err.code();
+                first_err.get_or_insert(err);
+                (ptr::null_mut(), code)
+            },
+            None => {
+                let err = if lost {
+                    wit_err!(Panic, "Parse worker panicked")
+                } else {
+                    wit_err!(Internal, "Spec was not parsed")
+                };
+                let code = err.code();
+                first_err.get_or_insert(err);
+                (ptr::null_mut(), code)
+            },
         };
-        let res_ty = funcs[i].result.clone();
-        safe_res.funcs.insert(
-            funcs[i].name.clone(), 
-            WITFunction {
-                iface: safe_res.iface.clone(),
-                align: safe_res.align.clone(),
-                name:  CString::new(funcs[i].name.as_str())?,
-                sig,
-                index: i,
-                res:   WITTypeDef { 
-                    iface: safe_res.iface.clone(), 
-                    align: safe_res.align.clone(), 
-                    name:  CString::new("")?,
-                    ty:    res_ty, 
-                    subty1: subtypedef_get_maybe(1, &safe_res.iface, &safe_res.align, Some(&funcs[i].result))?,
-                    subty2: subtypedef_get_maybe(2, &safe_res.iface, &safe_res.align, Some(&funcs[i].result))?,
-                },
+        out[i] = wit;
+        if !codes.is_null() {
+            unsafe {
+                *codes.add(i) = code;
             }
-        );
+        }
+    }
+    match first_err {
+        Some(err) => Err(err),
+        None => Ok(()),
     }
+}
+
+pub(crate) fn utf8(content: &[u8]) -> Result<&str> {
+    str::from_utf8(content)
+        .map_err(|e| WITErr::wrap(WITErrorCode::Parse, e.into()))
+}
 
-    let safe_res = Box::into_raw(Box::new(safe_res));
+fn wit_parse_str(content: &str, alloc: Option<Allocator>, res: *mut *mut WIT) -> Result<()> {
+    let safe_res = WIT::new(content, alloc)?;
+    let safe_res = new_handle(alloc, safe_res)?;
     unsafe {
         *res = safe_res;
     }
@@ -297,7 +680,7 @@ pub extern "C" fn wit_delete(_s: *mut WITSession, wit: *mut WIT) {
         return;
     }
     unsafe {
-        Box::from_raw(wit);
+        delete_handle(wit);
     }
 }
 
@@ -307,13 +690,13 @@ pub extern "C" fn wit_func_name_get(s: *mut WITSession, func: *const WITFunction
 }
 fn _wit_func_name_get(func: *const WITFunction, res: *mut *const c_char) -> Result<()> {
     if func.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid arguments"))
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
     }
-    let func = unsafe {
-        &*func
+    let (img, func) = unsafe {
+        record(func)
     };
     unsafe {
-        *res = func.name.as_ptr();
+        *res = img.name_ptr(func.name);
     }
     Ok(())
 }
@@ -324,13 +707,13 @@ pub extern "C" fn wit_func_count_get(s: *mut WITSession, wit: *const WIT, res: *
 }
 fn _wit_func_count_get(wit: *const WIT, res: *mut usize) -> Result<()> {
     if wit.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid arguments"))
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
     }
     let wit  = unsafe {
         &*wit
     };
     unsafe {
-        *res = wit.iface.functions.len();
+        *res = wit.image.view().main_funcs().len();
     }
     Ok(())
 }
@@ -341,20 +724,19 @@ pub extern "C" fn wit_func_get_by_index(s: *mut WITSession, wit: *const WIT, ind
 }
 fn _wit_func_get_by_index(wit: *const WIT, index: usize, res: *mut *const WITFunction) -> Result<()> {
     if wit.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid arguments"))
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
     }
     let wit  = unsafe {
         &*wit
     };
-    let name = &wit.iface.functions[index].name;
-    let func = wit.funcs.get(name);
-    if let Some(func) = func {
+    let img = wit.image.view();
+    if let Some(func) = img.main_funcs().get(index) {
         unsafe {
-            *res = func as *const WITFunction;
+            *res = img.handle(func);
         }
         Ok(())
     } else {
-        Err(anyhow!("Function `{}` not found", &name))
+        Err(wit_err!(OutOfBounds, "Function index out of bounds"))
     }
 }
 
@@ -364,7 +746,7 @@ pub extern "C" fn wit_func_get_by_name(s: *mut WITSession, wit: *const WIT, fnam
 }
 fn _wit_func_get_by_name(wit: *const WIT, fname: *const c_char, res: *mut *const WITFunction) -> Result<()> {
     if wit.is_null() || fname.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid arguments"))
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
     }
     let wit  = unsafe {
         &*wit
@@ -372,75 +754,127 @@ fn _wit_func_get_by_name(wit: *const WIT, fname: *const c_char, res: *mut *const
     let fname = unsafe {
         CStr::from_ptr(fname)
     };
-    let fname_str = fname.to_str()?;
-    if let Some(func) = wit.funcs.get(&fname_str.to_string()) {
+    func_get_by_name(wit, fname.to_bytes(), res)
+}
+
+// Like `wit_func_get_by_name`, but takes the name as `len` bytes, which
+// needn't be NUL-terminated.
+#[no_mangle]
+pub extern "C" fn wit_func_get_by_name_len(s: *mut WITSession, wit: *const WIT, fname: *const c_char, len: usize, res: *mut *const WITFunction) -> bool {
+    ffi_return!(s, _wit_func_get_by_name_len(wit, fname, len, res))
+}
+fn _wit_func_get_by_name_len(wit: *const WIT, fname: *const c_char, len: usize, res: *mut *const WITFunction) -> Result<()> {
+    if wit.is_null() || fname.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let wit  = unsafe {
+        &*wit
+    };
+    let fname = unsafe {
+        slice::from_raw_parts(fname as *const u8, len)
+    };
+    func_get_by_name(wit, fname, res)
+}
+
+fn func_get_by_name(wit: &WIT, fname: &[u8], res: *mut *const WITFunction) -> Result<()> {
+    let img = wit.image.view();
+    if let Some(idx) = img.func_index(fname) {
         unsafe {
-            *res = func as *const WITFunction;
+            *res = img.handle(&img.main_funcs()[idx]);
         }
         Ok(())
     } else {
-        Err(anyhow!("Function `{}` not found", &fname_str))
+        Err(WITErr::func_not_found(fname))
     }
 }
 
 #[no_mangle]
 pub extern "C" fn wit_func_param_walk<'a>(s: *mut WITSession, func: *const WITFunction, res: *mut *mut WITTypeDefIter<'a>) -> bool {
-    ffi_return!(s, _wit_func_param_walk(func, res))
+    ffi_return!(s, _wit_func_param_walk(hooks_of(s), func, res))
 }
-fn _wit_func_param_walk<'a>(func: *const WITFunction, res: *mut *mut WITTypeDefIter<'a>) -> Result<()> {
+fn _wit_func_param_walk<'a>(alloc: Option<Allocator>, func: *const WITFunction, res: *mut *mut WITTypeDefIter<'a>) -> Result<()> {
     if func.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let res_safe = new_handle(alloc, param_iter(func))?;
+    stat_add!(iters, 1);
+    stat_add!(bytes_allocated, std::mem::size_of::<WITTypeDefIter>());
+    unsafe {
+        *res = res_safe;
+    }
+    Ok(())
+}
+
+// Like `wit_func_param_walk`, but builds the iterator in `storage`.
+#[no_mangle]
+pub extern "C" fn wit_func_param_walk_in<'a>(s: *mut WITSession, func: *const WITFunction, storage: *mut WITIterStorage, res: *mut *mut WITTypeDefIter<'a>) -> bool {
+    ffi_return!(s, _wit_func_param_walk_in(func, storage, res))
+}
+fn _wit_func_param_walk_in<'a>(func: *const WITFunction, storage: *mut WITIterStorage, res: *mut *mut WITTypeDefIter<'a>) -> Result<()> {
+    if func.is_null() || storage.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
-    let func  = unsafe {
-        &*func
+    let res_safe = iter_in(storage, param_iter(func));
+    stat_add!(iters_in_place, 1);
+    unsafe {
+        *res = res_safe;
+    }
+    Ok(())
+}
+
+fn param_iter<'a>(func: *const WITFunction) -> WITTypeDefIter<'a> {
+    let (img, func) = unsafe {
+        record(func)
     };
-    let mut inner_iter = func.iface.functions[func.index].params.iter();
-    let next = inner_iter.next();
-    let item: Option<WITTypeDef> = match next {
-        Some(n) => {
-            Some(
-                WITTypeDef{ 
-                    iface: func.iface.clone(), 
-                    align: func.align.clone(),
-                    name:  CString::new(n.0.as_str())?,
-                    ty:    n.1.clone(),
-                    subty1: subtypedef_get_maybe(1, &func.iface, &func.align, Some(&n.1))?,
-                    subty2: subtypedef_get_maybe(2, &func.iface, &func.align, Some(&n.1))?,
-                }
-            )
-        },
-        _ => None
+    WITTypeDefIter {
+        run: Run::new(img, func.params(img)),
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn wit_func_param_count_get(s: *mut WITSession, func: *const WITFunction, res: *mut usize) -> bool {
+    ffi_return!(s, _wit_func_param_count_get(func, res))
+}
+fn _wit_func_param_count_get(func: *const WITFunction, res: *mut usize) -> Result<()> {
+    if func.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let (img, func) = unsafe {
+        record(func)
     };
-    let res_safe = 
-        Box::into_raw(
-            Box::new(
-                WITTypeDefIter {
-                    iface:      func.iface.clone(),
-                    align:      func.align.clone(),
-                    inner_iter,
-                    item,
-                }
-            )
-        );
     unsafe {
-        *res = res_safe;
+        *res = func.params(img).len();
     }
     Ok(())
 }
 
+#[no_mangle]
+pub extern "C" fn wit_func_param_get_by_index(s: *mut WITSession, func: *const WITFunction, index: usize, res: *mut *const WITTypeDef) -> bool {
+    ffi_return!(s, _wit_func_param_get_by_index(func, index, res))
+}
+fn _wit_func_param_get_by_index(func: *const WITFunction, index: usize, res: *mut *const WITTypeDef) -> Result<()> {
+    if func.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let (img, func) = unsafe {
+        record(func)
+    };
+    member_get_by_index(img, func.params(img), index, res)
+}
+
 #[no_mangle]
 pub extern "C" fn wit_func_result_get(s: *mut WITSession, func: *const WITFunction, res: *mut *const WITTypeDef) -> bool {
     ffi_return!(s, _wit_func_result_get(func, res))
 }
 fn _wit_func_result_get(func: *const WITFunction, res: *mut *const WITTypeDef) -> Result<()> {
     if func.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
-    let func = unsafe {
-        &*func
+    let (img, func) = unsafe {
+        record(func)
     };
     unsafe {
-        *res = &func.res;
+        *res = img.handle(img.typedef(func.result));
     }
     Ok(())
 }
@@ -453,7 +887,7 @@ pub extern "C" fn wit_typedef_iter_off(_s: *mut WITSession, iter: *const WITType
     let iter = unsafe {
         &*iter
     };
-    iter.item.is_none()
+    iter.run.item().is_none()
 }
 
 #[no_mangle]
@@ -462,119 +896,36 @@ pub extern "C" fn wit_typedef_iter_next(s: *mut WITSession, iter: *mut WITTypeDe
 }
 fn _wit_typedef_iter_next(iter: *mut WITTypeDefIter) -> Result<()> {
     if iter.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
     if wit_typedef_iter_off(ptr::null_mut(), iter) {
-        return Err(anyhow!("Iterator out of bounds!"));
+        return Err(wit_err!(OutOfBounds, "Iterator out of bounds!"));
     }
     let iter = unsafe {
         &mut *iter
     };
-    let next = iter.inner_iter.next();
-    iter.item = {
-        if let Some(next) = next {
-            Some(
-                WITTypeDef{ 
-                    iface: iter.iface.clone(), 
-                    align: iter.align.clone(),
-                    name:  CString::new(next.0.as_str())?, 
-                    ty:    next.1.clone(),
-                    subty1: subtypedef_get_maybe(1, &iter.iface, &iter.align, Some(&next.1))?,
-                    subty2: subtypedef_get_maybe(2, &iter.iface, &iter.align, Some(&next.1))?,
-                }
-            )
-        } else {
-            None
-        }
-    };
+    iter.run.next();
     Ok(())
 }
 
-fn subtypedef_get_maybe<'a>(which: i32, iface: &'a Rc<Interface>, align: &'a Rc<SizeAlign>, ty_opt: Option<&'a Type>) 
-    -> Result<Option<Box<WITTypeDef>>> 
-{
-    let ty: &'a Type;
-    if let Some(t) = ty_opt {
-        ty = t;
-    } else {
-        return Ok(None);
-    }
-    if let Type::Id(id) = ty {
-        match which {
-            1 => match &iface.types[*id].kind {
-                TypeDefKind::List(subty) |
-                TypeDefKind::Type(subty) => Ok(
-                    Some(
-                        Box::new(
-                            WITTypeDef {
-                                iface: iface.clone(),
-                                align: align.clone(),
-                                name:  CString::new("").unwrap(),
-                                ty:    subty.clone(),
-                                subty1: subtypedef_get_maybe(1, iface, align, Some(&subty))?,
-                                subty2: subtypedef_get_maybe(2, iface, align, Some(&subty))?,
-                            }
-                        )
-                    )
-                ),
-                TypeDefKind::Expected(exp) => Ok(
-                    Some(
-                        Box::new(
-                            WITTypeDef { 
-                                iface: iface.clone(),
-                                align: align.clone(), 
-                                name:  CString::new("ok").unwrap(),
-                                ty:    exp.ok.clone(),
-                                subty1: subtypedef_get_maybe(1, iface, align, Some(&exp.ok))?,
-                                subty2: subtypedef_get_maybe(2, iface, align, Some(&exp.ok))?,
-                            }
-                        )
-                    )
-                ),
-                _ => Ok(None),
-            },
-            2 => match &iface.types[*id].kind {
-                TypeDefKind::Expected(exp) => Ok(
-                    Some(
-                        Box::new(
-                            WITTypeDef { 
-                                iface: iface.clone(),
-                                align: align.clone(), 
-                                name:  CString::new("err").unwrap(),
-                                ty:    exp.err.clone(),
-                                subty1: subtypedef_get_maybe(1, iface, align, Some(&exp.err))?,
-                                subty2: subtypedef_get_maybe(2, iface, align, Some(&exp.err))?,
-                            }
-                        )
-                    )
-                ),
-                _ => Ok(None),
-            },
-            _ => Ok(None),
-        }
-    } else {
-        Ok(None)
-    }
-}
-
 #[no_mangle]
 pub extern "C" fn wit_typedef_iter_at<'a>(s: *mut WITSession, iter: *const WITTypeDefIter, res: *mut *const WITTypeDef) -> bool {
     ffi_return!(s, _wit_typedef_iter_at(iter, res))
 }
 fn _wit_typedef_iter_at(iter: *const WITTypeDefIter, res: *mut *const WITTypeDef) -> Result<()> {
     if iter.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
     let iter = unsafe {
         &*iter
     };
-    if let Some(item) = &iter.item {
+    if let Some(item) = iter.run.item() {
         unsafe {
-            *res = item as *const WITTypeDef;
+            *res = item;
         }
         Ok(())
     } else {
-        Err(anyhow!("Iterator out of bounds!"))
+        Err(wit_err!(OutOfBounds, "Iterator out of bounds!"))
     }
 }
 
@@ -582,61 +933,52 @@ fn _wit_typedef_iter_at(iter: *const WITTypeDefIter, res: *mut *const WITTypeDef
 pub extern "C" fn wit_typedef_iter_delete(_s: *mut WITSession, iter: *mut WITTypeDefIter) {
     if !iter.is_null() {
         unsafe {
-            Box::from_raw(iter);
+            delete_handle(iter);
         }
     }
 }
 
 #[no_mangle]
 pub extern "C" fn wit_record_field_walk<'a>(s: *mut WITSession, td: *const WITTypeDef, res: *mut *mut WITFieldIter<'a>) -> bool {
-    ffi_return!(s, _wit_record_field_walk(td, res))
+    ffi_return!(s, _wit_record_field_walk(hooks_of(s), td, res))
 }
-fn _wit_record_field_walk<'a>(td: *const WITTypeDef, res: *mut *mut WITFieldIter<'a>) -> Result<()> {
+fn _wit_record_field_walk<'a>(alloc: Option<Allocator>, td: *const WITTypeDef, res: *mut *mut WITFieldIter<'a>) -> Result<()> {
     if td.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
-    let td = unsafe {
-        &*td
-    };
-    if let Type::Id(id) = &td.ty {
-        if let TypeDefKind::Record(rec) = &td.iface.types[*id].kind {
-            let mut inner_iter = rec.fields.iter();
-            let next = inner_iter.next();
-            let item: Option<WITTypeDef> = match next {
-                Some(f) => 
-                    Some(
-                        WITTypeDef{ 
-                            iface: td.iface.clone(), 
-                            align: td.align.clone(),
-                            name:  CString::new(f.name.as_str())?, 
-                            ty:    f.ty.clone(),
-                            subty1: subtypedef_get_maybe(1, &td.iface, &td.align, Some(&f.ty))?,
-                            subty2: subtypedef_get_maybe(2, &td.iface, &td.align, Some(&f.ty))?,
-                        }
-                    ),
-                _ => None
-            };
-            let safe_res = 
-                Box::into_raw(
-                    Box::new(
-                        WITFieldIter {
-                            iface:      td.iface.clone(),
-                            align:      td.align.clone(),
-                            inner_iter,
-                            item
-                        }
-                    )
-                );
-            unsafe {
-                *res = safe_res;
-            }
-            Ok(())
-        } else {
-            Err(anyhow!("Invalid parameter.  Must be record type!"))
-        }
-    } else {
-        Err(anyhow!("Iterator out of bounds!"))
+    let safe_res = new_handle(alloc, field_iter(td)?)?;
+    stat_add!(iters, 1);
+    stat_add!(bytes_allocated, std::mem::size_of::<WITFieldIter>());
+    unsafe {
+        *res = safe_res;
+    }
+    Ok(())
+}
+
+// Like `wit_record_field_walk`, but builds the iterator in `storage`.
+#[no_mangle]
+pub extern "C" fn wit_record_field_walk_in<'a>(s: *mut WITSession, td: *const WITTypeDef, storage: *mut WITIterStorage, res: *mut *mut WITFieldIter<'a>) -> bool {
+    ffi_return!(s, _wit_record_field_walk_in(td, storage, res))
+}
+fn _wit_record_field_walk_in<'a>(td: *const WITTypeDef, storage: *mut WITIterStorage, res: *mut *mut WITFieldIter<'a>) -> Result<()> {
+    if td.is_null() || storage.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
+    let safe_res = iter_in(storage, field_iter(td)?);
+    stat_add!(iters_in_place, 1);
+    unsafe {
+        *res = safe_res;
+    }
+    Ok(())
+}
+
+fn field_iter<'a>(td: *const WITTypeDef) -> Result<WITFieldIter<'a>> {
+    let (img, fields) = record_fields(td)?;
+    Ok(
+        WITFieldIter {
+            run: Run::new(img, fields),
+        }
+    )
 }
 
 #[no_mangle]
@@ -647,7 +989,7 @@ pub extern "C" fn wit_field_iter_off(_s: *mut WITSession, iter: *const WITFieldI
     let iter = unsafe {
         &*iter
     };
-    iter.item.is_none()
+    iter.run.item().is_none()
 }
 
 #[no_mangle]
@@ -656,31 +998,15 @@ pub extern "C" fn wit_field_iter_next(s: *mut WITSession, iter: *mut WITFieldIte
 }
 fn _wit_field_iter_next(iter: *mut WITFieldIter) -> Result<()> {
     if iter.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
     if wit_field_iter_off(ptr::null_mut(), iter) {
-        return Err(anyhow!("Iterator out of bounds"));
+        return Err(wit_err!(OutOfBounds, "Iterator out of bounds"));
     }
     let iter = unsafe {
         &mut *iter
     };
-    let next = iter.inner_iter.next();
-    iter.item = {
-        if let Some(next) = next {
-            Some(
-                WITTypeDef{ 
-                    iface: iter.iface.clone(), 
-                    align: iter.align.clone(),
-                    name:  CString::new(next.name.as_str())?,
-                    ty:    next.ty.clone(),
-                    subty1: subtypedef_get_maybe(1, &iter.iface, &iter.align, Some(&next.ty))?,
-                    subty2: subtypedef_get_maybe(2, &iter.iface, &iter.align, Some(&next.ty))?,
-                }
-            )
-        } else {
-            None
-        }
-    };
+    iter.run.next();
     Ok(())
 }
 
@@ -690,18 +1016,39 @@ pub extern "C" fn wit_field_iter_at<'a>(s: *mut WITSession, iter: *const WITFiel
 }
 fn _wit_field_iter_at<'a>(iter: *const WITFieldIter<'a>, res: *mut *const WITTypeDef) -> Result<()> {
     if iter.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
     let iter = unsafe {
         &*iter
     };
-    if let Some(item) = &iter.item {
+    if let Some(item) = iter.run.item() {
         unsafe {
-            *res = item as *const WITTypeDef;
+            *res = item;
             Ok(())
         }
     } else {
-        Err(anyhow!("Iterator out of bounds!"))
+        Err(wit_err!(OutOfBounds, "Iterator out of bounds!"))
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn wit_field_iter_offset_get<'a>(s: *mut WITSession, iter: *const WITFieldIter<'a>, res: *mut usize) -> bool {
+    ffi_return!(s, _wit_field_iter_offset_get(iter, res))
+}
+fn _wit_field_iter_offset_get<'a>(iter: *const WITFieldIter<'a>, res: *mut usize) -> Result<()> {
+    if iter.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let iter = unsafe {
+        &*iter
+    };
+    if let Some(item) = iter.run.item() {
+        unsafe {
+            *res = (*item).offset as usize;
+        }
+        Ok(())
+    } else {
+        Err(wit_err!(OutOfBounds, "Iterator out of bounds!"))
     }
 }
 
@@ -709,8 +1056,70 @@ fn _wit_field_iter_at<'a>(iter: *const WITFieldIter<'a>, res: *mut *const WITTyp
 pub extern "C" fn wit_field_iter_delete(_s: *mut WITSession, iter: *mut WITFieldIter) {
     if !iter.is_null() {
         unsafe {
-            Box::from_raw(iter);
+            delete_handle(iter);
+        }
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn wit_record_field_count_get(s: *mut WITSession, td: *const WITTypeDef, res: *mut usize) -> bool {
+    ffi_return!(s, _wit_record_field_count_get(td, res))
+}
+fn _wit_record_field_count_get(td: *const WITTypeDef, res: *mut usize) -> Result<()> {
+    if td.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let (_, fields) = record_fields(td)?;
+    unsafe {
+        *res = fields.len();
+    }
+    Ok(())
+}
+
+#[no_mangle]
+pub extern "C" fn wit_record_field_get_by_index(s: *mut WITSession, td: *const WITTypeDef, index: usize, res: *mut *const WITTypeDef) -> bool {
+    ffi_return!(s, _wit_record_field_get_by_index(td, index, res))
+}
+fn _wit_record_field_get_by_index(td: *const WITTypeDef, index: usize, res: *mut *const WITTypeDef) -> Result<()> {
+    if td.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let (img, fields) = record_fields(td)?;
+    member_get_by_index(img, fields, index, res)
+}
+
+// Finds a record field by name.  Fields are compared in order, without
+// allocating.
+#[no_mangle]
+pub extern "C" fn wit_record_field_get_by_name(s: *mut WITSession, td: *const WITTypeDef, fname: *const c_char, res: *mut *const WITTypeDef) -> bool {
+    ffi_return!(s, _wit_record_field_get_by_name(td, fname, res))
+}
+fn _wit_record_field_get_by_name(td: *const WITTypeDef, fname: *const c_char, res: *mut *const WITTypeDef) -> Result<()> {
+    if td.is_null() || fname.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let fname = unsafe {
+        CStr::from_ptr(fname)
+    };
+    let (img, fields) = record_fields(td)?;
+    if let Some(field) = fields.iter().find(|f| img.name(f.name) == fname.to_bytes()) {
+        unsafe {
+            *res = img.handle(field);
         }
+        Ok(())
+    } else {
+        Err(wit_err!(NotFound, "Field not found"))
+    }
+}
+
+fn record_fields<'a>(td: *const WITTypeDef) -> Result<(ImageRef<'a>, &'a [WITTypeDef])> {
+    let (img, td) = unsafe {
+        record(td)
+    };
+    if td.kind(img) == WITType::Record {
+        Ok((img, td.members(img)))
+    } else {
+        Err(wit_err!(WrongType, "Invalid parameter.  Must be record type!"))
     }
 }
 
@@ -720,83 +1129,90 @@ pub extern "C" fn wit_variant_tag_get(s: *mut WITSession, td: *const WITTypeDef,
 }
 fn _wit_variant_tag_get(td: *const WITTypeDef, res: *mut u8) -> Result<()> {
     if td.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
-    let td = unsafe {
-        &*td
+    let (img, td) = unsafe {
+        record(td)
     };
-    if let Type::Id(id) = &td.ty {
-        if let TypeDefKind::Variant(v) = &td.iface.types[*id].kind {
-            let bits = match v.tag() {
-                Int::U8 => 1,
-                Int::U16 => 2,
-                Int::U32 => 4,
-                Int::U64 => 8,
-            };
-            unsafe {
-                *res = bits;
-            }
-            Ok(())
-        } else {
-            Err(anyhow!("Invalid argument; must be a Variant type"))
+    if td.kind(img) == WITType::Variant {
+        unsafe {
+            *res = td.rec(img).tag as u8;
         }
+        Ok(())
     } else {
-        Err(anyhow!("Invalid argument; must be a Variant type"))
+        Err(wit_err!(WrongType, "Invalid argument; must be a Variant type"))
     }
 }
 
+// Gets the byte offset of the payload within a variant-like type (variant,
+// union, option or expected).  The offset is the same for every case.
 #[no_mangle]
-pub extern "C" fn wit_variant_case_walk<'a>(s: *mut WITSession, td: *const WITTypeDef, res: *mut *mut WITCaseIter<'a>) -> bool {
-    ffi_return!(s, _wit_variant_case_walk(td, res))
+pub extern "C" fn wit_variant_payload_offset_get(s: *mut WITSession, td: *const WITTypeDef, res: *mut usize) -> bool {
+    ffi_return!(s, _wit_variant_payload_offset_get(td, res))
 }
-fn _wit_variant_case_walk<'a>(td: *const WITTypeDef, res: *mut *mut WITCaseIter<'a>) -> Result<()> {
+fn _wit_variant_payload_offset_get(td: *const WITTypeDef, res: *mut usize) -> Result<()> {
     if td.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
-    let td = unsafe {
-        &*td
+    let (img, td) = unsafe {
+        record(td)
     };
-    if let Type::Id(id) = &td.ty {
-        if let TypeDefKind::Variant(v) = &td.iface.types[*id].kind {
-            let mut inner_iter = v.cases.iter();
-            let next = inner_iter.next();
-            let item: Option<WITTypeDef> = match next {
-                Some(c) => {
-                    Some(
-                        WITTypeDef{
-                            iface: td.iface.clone(),
-                            align: td.align.clone(),
-                            name:  CString::new(c.name.as_str())?,
-                            ty:    c.ty.clone(),
-                            subty1: subtypedef_get_maybe(1, &td.iface, &td.align, Some(&c.ty))?,
-                            subty2: subtypedef_get_maybe(2, &td.iface, &td.align, Some(&c.ty))?,
-                        }
-                    )
-                },
-                _ => None
-            };
-            let safe_res = 
-                Box::into_raw(
-                    Box::new(
-                        WITCaseIter {
-                            iface:   td.iface.clone(),
-                            align:   td.align.clone(),
-                            inner_iter,
-                            item
-                        }
-                    )
-                );
+    match td.kind(img) {
+        WITType::Variant |
+        WITType::Union |
+        WITType::Option |
+        WITType::Expected => {
             unsafe {
-                *res = safe_res;
+                *res = td.rec(img).payload as usize;
             }
             Ok(())
-        } else {
-            Err(anyhow!("Invalid argument.  Must be a variant type!"))
-        }
-    } else {
-        Err(anyhow!("Iterator out of bounds!"))
+        },
+        _ => Err(wit_err!(WrongType, "Invalid argument; must be a Variant type"))
     }
 }
+
+#[no_mangle]
+pub extern "C" fn wit_variant_case_walk<'a>(s: *mut WITSession, td: *const WITTypeDef, res: *mut *mut WITCaseIter<'a>) -> bool {
+    ffi_return!(s, _wit_variant_case_walk(hooks_of(s), td, res))
+}
+fn _wit_variant_case_walk<'a>(alloc: Option<Allocator>, td: *const WITTypeDef, res: *mut *mut WITCaseIter<'a>) -> Result<()> {
+    if td.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let safe_res = new_handle(alloc, case_iter(td)?)?;
+    stat_add!(iters, 1);
+    stat_add!(bytes_allocated, std::mem::size_of::<WITCaseIter>());
+    unsafe {
+        *res = safe_res;
+    }
+    Ok(())
+}
+
+// Like `wit_variant_case_walk`, but builds the iterator in `storage`.
+#[no_mangle]
+pub extern "C" fn wit_variant_case_walk_in<'a>(s: *mut WITSession, td: *const WITTypeDef, storage: *mut WITIterStorage, res: *mut *mut WITCaseIter<'a>) -> bool {
+    ffi_return!(s, _wit_variant_case_walk_in(td, storage, res))
+}
+fn _wit_variant_case_walk_in<'a>(td: *const WITTypeDef, storage: *mut WITIterStorage, res: *mut *mut WITCaseIter<'a>) -> Result<()> {
+    if td.is_null() || storage.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let safe_res = iter_in(storage, case_iter(td)?);
+    stat_add!(iters_in_place, 1);
+    unsafe {
+        *res = safe_res;
+    }
+    Ok(())
+}
+
+fn case_iter<'a>(td: *const WITTypeDef) -> Result<WITCaseIter<'a>> {
+    let (img, cases) = variant_cases(td)?;
+    Ok(
+        WITCaseIter {
+            run: Run::new(img, cases),
+        }
+    )
+}
 #[no_mangle]
 pub extern "C" fn wit_case_iter_off(_s: *mut WITSession, iter: *const WITCaseIter) -> bool {
     if iter.is_null() {
@@ -805,7 +1221,7 @@ pub extern "C" fn wit_case_iter_off(_s: *mut WITSession, iter: *const WITCaseIte
     let iter = unsafe {
         &*iter
     };
-    iter.item.is_none()
+    iter.run.item().is_none()
 }
 
 #[no_mangle]
@@ -814,31 +1230,15 @@ pub extern "C" fn wit_case_iter_next(s: *mut WITSession, iter: *mut WITCaseIter)
 }
 fn _wit_case_iter_next(iter: *mut WITCaseIter) -> Result<()> {
     if iter.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
     if wit_case_iter_off(ptr::null_mut(), iter) {
-        return Err(anyhow!("Iterator out of bounds"));
+        return Err(wit_err!(OutOfBounds, "Iterator out of bounds"));
     }
     let iter = unsafe {
         &mut *iter
     };
-    let next = iter.inner_iter.next();
-    iter.item = {
-        if let Some(next) = next {
-            Some(
-                WITTypeDef{ 
-                    iface: iter.iface.clone(), 
-                    align: iter.align.clone(),
-                    name:  CString::new(next.name.as_str())?,
-                    ty:    next.ty.clone(),
-                    subty1: subtypedef_get_maybe(1, &iter.iface, &iter.align, Some(&next.ty))?,
-                    subty2: subtypedef_get_maybe(2, &iter.iface, &iter.align, Some(&next.ty))?,
-                }
-            )
-        } else {
-            None
-        }
-    };
+    iter.run.next();
     Ok(())
 }
 
@@ -848,18 +1248,18 @@ pub extern "C" fn wit_case_iter_at<'a>(s: *mut WITSession, iter: *const WITCaseI
 }
 fn _wit_case_iter_at<'a>(iter: *const WITCaseIter<'a>, res: *mut *const WITTypeDef) -> Result<()> {
     if iter.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
     let iter = unsafe {
         &*iter
     };
-    if let Some(item) = &iter.item {
+    if let Some(item) = iter.run.item() {
         unsafe {
-            *res = item as *const WITTypeDef;
+            *res = item;
             Ok(())
         }
     } else {
-        Err(anyhow!("Iterator out of bounds!"))
+        Err(wit_err!(OutOfBounds, "Iterator out of bounds!"))
     }
 }
 
@@ -867,8 +1267,57 @@ fn _wit_case_iter_at<'a>(iter: *const WITCaseIter<'a>, res: *mut *const WITTypeD
 pub extern "C" fn wit_case_iter_delete(_s: *mut WITSession, iter: *mut WITCaseIter) {
     if !iter.is_null() {
         unsafe {
-            Box::from_raw(iter);
+            delete_handle(iter);
+        }
+    }
+}
+
+#[no_mangle]
+pub extern "C" fn wit_variant_case_count_get(s: *mut WITSession, td: *const WITTypeDef, res: *mut usize) -> bool {
+    ffi_return!(s, _wit_variant_case_count_get(td, res))
+}
+fn _wit_variant_case_count_get(td: *const WITTypeDef, res: *mut usize) -> Result<()> {
+    if td.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let (_, cases) = variant_cases(td)?;
+    unsafe {
+        *res = cases.len();
+    }
+    Ok(())
+}
+
+#[no_mangle]
+pub extern "C" fn wit_variant_case_get_by_index(s: *mut WITSession, td: *const WITTypeDef, index: usize, res: *mut *const WITTypeDef) -> bool {
+    ffi_return!(s, _wit_variant_case_get_by_index(td, index, res))
+}
+fn _wit_variant_case_get_by_index(td: *const WITTypeDef, index: usize, res: *mut *const WITTypeDef) -> Result<()> {
+    if td.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let (img, cases) = variant_cases(td)?;
+    member_get_by_index(img, cases, index, res)
+}
+
+fn variant_cases<'a>(td: *const WITTypeDef) -> Result<(ImageRef<'a>, &'a [WITTypeDef])> {
+    let (img, td) = unsafe {
+        record(td)
+    };
+    if td.kind(img) == WITType::Variant {
+        Ok((img, td.members(img)))
+    } else {
+        Err(wit_err!(WrongType, "Invalid argument.  Must be a variant type!"))
+    }
+}
+
+fn member_get_by_index(img: ImageRef, members: &[WITTypeDef], index: usize, res: *mut *const WITTypeDef) -> Result<()> {
+    if let Some(member) = members.get(index) {
+        unsafe {
+            *res = img.handle(member);
         }
+        Ok(())
+    } else {
+        Err(wit_err!(OutOfBounds, "Index out of bounds"))
     }
 }
 
@@ -882,34 +1331,24 @@ pub extern "C" fn wit_expected_err_typedef_get(s: *mut WITSession, td: *const WI
 }
 fn _wit_expected_typedef_get(get_ok: bool, td: *const WITTypeDef, res: *mut *const WITTypeDef) -> Result<()> {
     if td.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"))
-    }
-    let td = unsafe { &*td };
-    if let Type::Id(id) = &td.ty {
-        if let TypeDefKind::Expected(_) = &td.iface.types[*id].kind {
-            let subty_opt = {
-                if get_ok {
-                    &td.subty1
-                } else {
-                    &td.subty2
-                }
-            };
-            match subty_opt {
-                Some(subty) => {
-                    unsafe {
-                        *res = &**subty as *const WITTypeDef;
-                    }
-                    Ok(())
-                },
-                _ => {
-                    Err(anyhow!("Could not determine array element type!"))
+        return Err(wit_err!(InvalidArgument, "Invalid argument"))
+    }
+    let (img, td) = unsafe { record(td) };
+    if td.kind(img) == WITType::Expected {
+        // The `ok` and `err` members, in that order.
+        match td.members(img).get(if get_ok { 0 } else { 1 }) {
+            Some(subty) => {
+                unsafe {
+                    *res = img.handle(subty);
                 }
+                Ok(())
+            },
+            _ => {
+                Err(wit_err!(Internal, "Could not determine expected type!"))
             }
-        } else {
-            Err(anyhow!("Invalid parameter.  Must be list type!"))
         }
     } else {
-        Err(anyhow!("Invalid parameter.  Must be 'expected' type!"))
+        Err(wit_err!(WrongType, "Invalid parameter.  Must be 'expected' type!"))
     }
 }
 
@@ -919,31 +1358,40 @@ pub extern "C" fn wit_type_aliased_typedef_get(s: *mut WITSession, td: *const WI
 }
 fn _wit_type_aliased_typedef_get(td: *const WITTypeDef, res: *mut *const WITTypeDef) -> Result<()> {
     if td.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
-    let td = unsafe {
-        &*td
+    let (img, td) = unsafe {
+        record(td)
     };
-    if let Type::Id(id) = &td.ty {
-        if let TypeDefKind::Type(_) = &td.iface.types[*id].kind {
-            // Return cached subtype, if it exists.
-            match &td.subty1 {
-                Some(subty) => {
-                    unsafe {
-                        *res = &**subty as *const WITTypeDef;
-                    }
-                    Ok(())
-                },
-                _ => {
-                    Err(anyhow!("Could not determine aliased type!"))
-                }
-            }
-        } else {
-            Err(anyhow!("Invalid parameter.  Must be 'type' type!"))
+    if td.kind(img) == WITType::Type {
+        unsafe {
+            *res = img.handle(td.elem(img));
         }
+        Ok(())
     } else {
-        Err(anyhow!("Invalid parameter.  Must be 'type' type!"))
+        Err(wit_err!(WrongType, "Invalid parameter.  Must be 'type' type!"))
+    }
+}
+
+// Like following `wit_type_aliased_typedef_get` until the type isn't an
+// alias, but in one step: chains are resolved when the spec is parsed.
+// Gives `td` itself if it isn't an alias.  The alias's own name (and
+// offset, as a field) are still `td`'s.
+#[no_mangle]
+pub extern "C" fn wit_typedef_resolved_get(s: *mut WITSession, td: *const WITTypeDef, res: *mut *const WITTypeDef) -> bool {
+    ffi_return!(s, _wit_typedef_resolved_get(td, res))
+}
+fn _wit_typedef_resolved_get(td: *const WITTypeDef, res: *mut *const WITTypeDef) -> Result<()> {
+    if td.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let (img, td) = unsafe {
+        record(td)
+    };
+    unsafe {
+        *res = img.handle(td.resolved(img));
     }
+    Ok(())
 }
 
 #[no_mangle]
@@ -952,30 +1400,18 @@ pub extern "C" fn wit_list_elem_typedef_get(s: *mut WITSession, td: *const WITTy
 }
 fn _wit_list_elem_typedef_get(td: *const WITTypeDef, res: *mut *const WITTypeDef) -> Result<()> {
     if td.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
-    let td = unsafe {
-        &*td
+    let (img, td) = unsafe {
+        record(td)
     };
-    if let Type::Id(id) = &td.ty {
-        if let TypeDefKind::List(_) = &td.iface.types[*id].kind {
-            // Return cached subtype, if it exists.
-            match &td.subty1 {
-                Some(subty) => {
-                    unsafe {
-                        *res = &**subty as *const WITTypeDef;
-                    }
-                    Ok(())
-                },
-                _ => {
-                    Err(anyhow!("Could not determine array element type!"))
-                }
-            }
-        } else {
-            Err(anyhow!("Invalid parameter.  Must be list type!"))
+    if td.kind(img) == WITType::List {
+        unsafe {
+            *res = img.handle(td.elem(img));
         }
+        Ok(())
     } else {
-        Err(anyhow!("Invalid parameter.  Must be list type!"))
+        Err(wit_err!(WrongType, "Invalid parameter.  Must be list type!"))
     }
 }
 
@@ -985,13 +1421,13 @@ pub extern "C" fn wit_typedef_name_get(s: *mut WITSession, td: *const WITTypeDef
 }
 fn _wit_typedef_name_get(td: *const WITTypeDef, res: *mut *const c_char) -> Result<()> {
     if td.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
-    let td = unsafe {
-        &*td
+    let (img, td) = unsafe {
+        record(td)
     };
     unsafe {
-        *res = td.name.as_ptr()
+        *res = img.name_ptr(td.name)
     }
     Ok(())
 }
@@ -1002,13 +1438,13 @@ pub extern "C" fn wit_typedef_align_get(s: *mut WITSession, td: *const WITTypeDe
 }
 fn _wit_typedef_align_get(td: *const WITTypeDef, res: *mut usize) -> Result<()> {
     if td.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
-    let td = unsafe {
-        &*td
+    let (img, td) = unsafe {
+        record(td)
     };
     unsafe {
-        *res = td.align.align(&td.ty);
+        *res = td.rec(img).align as usize;
     }
     Ok(())
 }
@@ -1019,13 +1455,32 @@ pub extern "C" fn wit_typedef_size_get(s: *mut WITSession, td: *const WITTypeDef
 }
 fn _wit_typedef_size_get(td: *const WITTypeDef, res: *mut usize) -> Result<()> {
     if td.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let (img, td) = unsafe {
+        record(td)
+    };
+    unsafe {
+        *res = td.rec(img).size as usize;
+    }
+    Ok(())
+}
+
+// Gets the byte offset of a record/tuple field or variant case within its
+// enclosing type.  Params, results, list elements and aliased types are at 0.
+#[no_mangle]
+pub extern "C" fn wit_typedef_offset_get(s: *mut WITSession, td: *const WITTypeDef, res: *mut usize) -> bool {
+    ffi_return!(s, _wit_typedef_offset_get(td, res))
+}
+fn _wit_typedef_offset_get(td: *const WITTypeDef, res: *mut usize) -> Result<()> {
+    if td.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
     let td = unsafe {
         &*td
     };
     unsafe {
-        *res = td.align.size(&td.ty);
+        *res = td.offset as usize;
     }
     Ok(())
 }
@@ -1036,43 +1491,13 @@ pub extern "C" fn wit_typedef_type_get(s: *mut WITSession, td: *const WITTypeDef
 }
 fn _wit_typedef_type_get(td: *const WITTypeDef, res: *mut WITType) -> Result<()> {
     if td.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
-    let td = unsafe {
-        &*td
-    };
-    let ty = match &td.ty {
-        Type::Unit => WITType::Unit,
-        Type::Bool => WITType::Bool,
-        Type::U8 => WITType::U8,
-        Type::U16 => WITType::U16,
-        Type::U32 => WITType::U32,
-        Type::U64 => WITType::U64,
-        Type::S8 => WITType::S8,
-        Type::S16 => WITType::S16,
-        Type::S32 => WITType::S32,
-        Type::S64 => WITType::S64,
-        Type::Float32 => WITType::Float32,
-        Type::Float64 => WITType::Float64,
-        Type::Char => WITType::Char,
-        Type::String => WITType::String,
-        Type::Handle(_) => WITType::Handle,
-        Type::Id(id) => match td.iface.types[*id].kind {
-            TypeDefKind::Flags(_) => WITType::Flags,
-            TypeDefKind::Expected(_) => WITType::Expected,
-            TypeDefKind::Option(_) => WITType::Option,
-            TypeDefKind::Union(_) => WITType::Union,
-            TypeDefKind::Enum(_) => WITType::Enum,
-            TypeDefKind::Tuple(_) => WITType::Tuple,
-            TypeDefKind::Record(_) => WITType::Record,
-            TypeDefKind::List(_) => WITType::List,
-            TypeDefKind::Variant(_) => WITType::Variant,
-            TypeDefKind::Type(_) => WITType::Type,
-            TypeDefKind::Stream(_) => WITType::Stream,
-        },
+    let (img, td) = unsafe {
+        record(td)
     };
     unsafe {
-        *res = ty;
+        *res = td.kind(img);
     }
     Ok(())
 }
@@ -1083,13 +1508,33 @@ pub extern "C" fn wit_func_sig_get(s: *mut WITSession, func: *const WITFunction,
 }
 fn _wit_func_sig_get(func: *const WITFunction, res: *mut *const WITSignature) -> Result<()> {
     if func.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let (img, func) = unsafe {
+        record(func)
+    };
+    unsafe {
+        *res = img.handle(func.sig(WITAbiVariant::GuestExport));
+    }
+    Ok(())
+}
+
+// Gets a function's signature for either ABI variant.  Both are computed
+// when the spec is parsed, so this is as cheap as `wit_func_sig_get`,
+// which gets the `GuestExport` one.
+#[no_mangle]
+pub extern "C" fn wit_func_sig_get_variant(s: *mut WITSession, func: *const WITFunction, variant: WITAbiVariant, res: *mut *const WITSignature) -> bool {
+    ffi_return!(s, _wit_func_sig_get_variant(func, variant, res))
+}
+fn _wit_func_sig_get_variant(func: *const WITFunction, variant: WITAbiVariant, res: *mut *const WITSignature) -> Result<()> {
+    if func.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
-    let func  = unsafe {
-        &*func
+    let (img, func) = unsafe {
+        record(func)
     };
     unsafe {
-        *res = &func.sig as *const WITSignature; 
+        *res = img.handle(func.sig(variant));
     }
     Ok(())
 }
@@ -1100,15 +1545,15 @@ pub extern "C" fn wit_sig_is_indirect(s: *mut WITSession, sig: *const WITSignatu
 }
 fn _wit_sig_is_indirect(sig: *const WITSignature, part: WITSigPart, res: *mut bool) -> Result<()> {
     if sig.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
     let sig = unsafe {
         &*sig
     };
     let indirect =
         match part {
-            WITSigPart::Params => sig.sig.indirect_params,
-            WITSigPart::Results => sig.sig.retptr,
+            WITSigPart::Params => sig.indirect_params != 0,
+            WITSigPart::Results => sig.retptr != 0,
         };
     unsafe {
         *res = indirect;
@@ -1122,18 +1567,13 @@ pub extern "C" fn wit_sig_length_get(s: *mut WITSession, sig: *const WITSignatur
 }
 fn _wit_sig_length_get(sig: *const WITSignature, part: WITSigPart, res: *mut usize) -> Result<()> {
     if sig.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
-    let sig  = unsafe {
-        &*sig
+    let (img, sig) = unsafe {
+        record(sig)
     };
-    let len =
-        match part {
-            WITSigPart::Params  => sig.sig.params.len(),
-            WITSigPart::Results => sig.sig.results.len(),
-        };
     unsafe { 
-        *res = len; 
+        *res = sig.part(img, part).len(); 
     }
     Ok(())
 }
@@ -1144,18 +1584,64 @@ pub extern "C" fn wit_sig_type_get_by_index(s: *mut WITSession, sig: *const WITS
 }
 fn _wit_sig_type_get_by_index(sig: *const WITSignature, part: WITSigPart, idx: usize, res: *mut WASMType) -> Result<()> {
     if sig.is_null() || res.is_null() {
-        return Err(anyhow!("Invalid argument"));
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
     }
-    let sig  = unsafe {
-        &*sig
+    let (img, sig) = unsafe {
+        record(sig)
     };
-    let v = 
-        match part {
-            WITSigPart::Params => &sig.sig.params,
-            WITSigPart::Results => &sig.sig.results,
-        };
+    let v = sig.part(img, part);
+    if idx >= v.len() {
+        return Err(wit_err!(OutOfBounds, "Index out of bounds"));
+    }
     unsafe { 
-        *res = From::from(v[idx]);
+        *res = v[idx];
+    }
+    Ok(())
+}
+
+// Copies up to `cap` types of one part of the signature into `out`, and
+// sets `len` to the part's full length.  If `len` comes back larger than
+// `cap`, the copy was truncated; `out` may be NULL when `cap` is 0, to
+// just query the length.
+#[no_mangle]
+pub extern "C" fn wit_sig_types_copy(s: *mut WITSession, sig: *const WITSignature, part: WITSigPart, out: *mut WASMType, cap: usize, len: *mut usize) -> bool {
+    ffi_return!(s, _wit_sig_types_copy(sig, part, out, cap, len))
+}
+fn _wit_sig_types_copy(sig: *const WITSignature, part: WITSigPart, out: *mut WASMType, cap: usize, len: *mut usize) -> Result<()> {
+    if sig.is_null() || len.is_null() || (out.is_null() && cap > 0) {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let (img, sig) = unsafe {
+        record(sig)
+    };
+    let v = sig.part(img, part);
+    let n = v.len().min(cap);
+    unsafe {
+        if n > 0 {
+            ptr::copy_nonoverlapping(v.as_ptr(), out, n);
+        }
+        *len = v.len();
+    }
+    Ok(())
+}
+
+// Returns one part of the signature as a contiguous array of `len` types.
+// The array lives as long as the `WIT`.
+#[no_mangle]
+pub extern "C" fn wit_sig_types_get(s: *mut WITSession, sig: *const WITSignature, part: WITSigPart, res: *mut *const WASMType, len: *mut usize) -> bool {
+    ffi_return!(s, _wit_sig_types_get(sig, part, res, len))
+}
+fn _wit_sig_types_get(sig: *const WITSignature, part: WITSigPart, res: *mut *const WASMType, len: *mut usize) -> Result<()> {
+    if sig.is_null() || res.is_null() || len.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid argument"));
+    }
+    let (img, sig) = unsafe {
+        record(sig)
+    };
+    let v = sig.part(img, part);
+    unsafe {
+        *res = v.as_ptr();
+        *len = v.len();
     }
     Ok(())
 }
@@ -0,0 +1,76 @@
+// Read-only file mappings, for reading specs and serialized WITs in place.
+
+use libc::c_char;
+use std::convert::TryFrom;
+use std::ffi::{CStr, OsStr};
+use std::fs::OpenOptions;
+use std::io::ErrorKind;
+use std::os::unix::ffi::OsStrExt;
+use std::os::unix::fs::OpenOptionsExt;
+use std::os::unix::io::AsRawFd;
+use std::path::Path;
+use std::ptr;
+use std::slice;
+
+use crate::error::{Result, WITErr, WITErrorCode};
+
+// A whole file, mapped read-only and shared, so every process mapping the
+// same file shares its pages.  Unmapped on drop.
+pub(crate) struct Mapping {
+    start: *const u8,
+    len:   usize,
+}
+impl Mapping {
+    // Only non-empty regular files can be mapped.  Anything else -- a
+    // directory, a FIFO, a file truncated to nothing -- is rejected up
+    // front rather than left to fail in `mmap` or pass for an empty spec.
+    pub(crate) fn open(path: &Path) -> Result<Mapping> {
+        let io = |e: std::io::Error| match e.kind() {
+            ErrorKind::NotFound => WITErr::wrap(WITErrorCode::NotFound, e.into()),
+            _ => WITErr::wrap(WITErrorCode::Io, e.into()),
+        };
+        // Non-blocking, so opening a FIFO doesn't wait for a writer before
+        // it can be turned away.
+        let file = OpenOptions::new().read(true).custom_flags(libc::O_NONBLOCK).open(path).map_err(io)?;
+        let meta = file.metadata().map_err(io)?;
+        if !meta.is_file() {
+            return Err(wit_err!(InvalidArgument, "Not a regular file"));
+        }
+        let len = usize::try_from(meta.len()).map_err(|_| wit_err!(OutOfBounds, "File too large to map"))?;
+        if len == 0 {
+            return Err(wit_err!(InvalidArgument, "Empty file"));
+        }
+        let start = unsafe {
+            libc::mmap(ptr::null_mut(), len, libc::PROT_READ, libc::MAP_SHARED, file.as_raw_fd(), 0)
+        };
+        if start == libc::MAP_FAILED {
+            return Err(io(std::io::Error::last_os_error()));
+        }
+        Ok(Mapping { start: start as *const u8, len })
+    }
+
+    // Opens the file at a C path.
+    pub(crate) fn open_c(path: *const c_char) -> Result<Mapping> {
+        let path = unsafe {
+            CStr::from_ptr(path)
+        };
+        Mapping::open(Path::new(OsStr::from_bytes(path.to_bytes())))
+    }
+
+    // The mapped bytes.  Page-aligned, so any record type can be read
+    // from them.
+    pub(crate) fn bytes(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.start, self.len) }
+    }
+}
+impl Drop for Mapping {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.start as *mut libc::c_void, self.len);
+        }
+    }
+}
+
+// Mappings are read-only.
+unsafe impl Send for Mapping {}
+unsafe impl Sync for Mapping {}
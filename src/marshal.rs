@@ -0,0 +1,353 @@
+// Batch marshalling: moves a whole column of values between host buffers
+// and wasm linear memory at once, instead of lowering one row at a time.
+//
+// Lists come in and go out as Arrow-style columns: one values buffer
+// holding every row's elements back to back, and `rows + 1` ascending
+// element offsets into it.  In linear memory each row is a canonical-ABI
+// (ptr, len) pair.  Records come in and go out as one column per field,
+// and are packed into (or unpacked from) a run of records laid out as in
+// linear memory.
+//
+// Only types whose canonical form is a plain copy of their host bytes are
+// handled: lists of fixed-size primitives and strings, and records of any
+// fields given in canonical form (e.g. the (ptr, len) pairs produced for a
+// list column).
+
+use std::convert::TryFrom;
+use std::ptr;
+
+use crate::{ImageRef, WITSession, WITType, WITTypeDef, record};
+use crate::error::{Result, check};
+#[cfg(feature="catch_panics")]
+use crate::error::{WITErr, WITErrorCode, error_set};
+#[cfg(feature="catch_panics")]
+use std::panic::{catch_unwind, AssertUnwindSafe};
+
+// Element size and alignment of a list-like type: a list of a primitive,
+// or a string (a list of UTF-8 bytes).  Aliases, of the list or of its
+// element, are seen through.
+fn list_elem(img: ImageRef, td: &WITTypeDef) -> Result<(usize, usize)> {
+    let td = td.resolved(img);
+    match td.kind(img) {
+        WITType::String => Ok((1, 1)),
+        WITType::List => {
+            let elem = td.elem(img).resolved(img).rec(img);
+            match elem.kind() {
+                WITType::Bool | WITType::U8 | WITType::U16 | WITType::U32 | WITType::U64 |
+                WITType::S8 | WITType::S16 | WITType::S32 | WITType::S64 |
+                WITType::Float32 | WITType::Float64 | WITType::Char => {
+                    Ok((elem.size as usize, elem.align as usize))
+                },
+                _ => Err(wit_err!(WrongType, "Invalid argument; list elements must be primitives")),
+            }
+        },
+        _ => Err(wit_err!(WrongType, "Invalid argument; must be a list or string type")),
+    }
+}
+
+// Copies `rows` values of `size` bytes from `src` to `dst`, stepping each
+// by its own stride.  The common sizes get loops of their own, which the
+// compiler can vectorize.
+unsafe fn strided_copy(src: *const u8, src_stride: usize, dst: *mut u8, dst_stride: usize, size: usize, rows: usize) {
+    unsafe fn typed<T: Copy>(src: *const u8, src_stride: usize, dst: *mut u8, dst_stride: usize, rows: usize) {
+        for i in 0..rows {
+            let val = ptr::read_unaligned(src.add(i * src_stride) as *const T);
+            ptr::write_unaligned(dst.add(i * dst_stride) as *mut T, val);
+        }
+    }
+    match size {
+        0 => {},
+        1 => typed::<u8>(src, src_stride, dst, dst_stride, rows),
+        2 => typed::<u16>(src, src_stride, dst, dst_stride, rows),
+        4 => typed::<u32>(src, src_stride, dst, dst_stride, rows),
+        8 => typed::<u64>(src, src_stride, dst, dst_stride, rows),
+        _ => {
+            for i in 0..rows {
+                ptr::copy_nonoverlapping(src.add(i * src_stride), dst.add(i * dst_stride), size);
+            }
+        },
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Lowers a column of lists (or strings) into linear memory.  Row `i` is the
+// elements `[offsets[i], offsets[i + 1])` of `values`.  Rows sit back to
+// back in the column, so they are copied to `mem + dst` in one go, and
+// `pairs` (2 * `rows` values) gets each row's (ptr, len), with `len` in
+// elements.  `dst` must be aligned for the element type, and the copy must
+// fit within the `mem_len` bytes of linear memory.
+#[no_mangle]
+pub extern "C" fn wit_list_lower_batch(s: *mut WITSession, td: *const WITTypeDef, values: *const u8, offsets: *const u32, rows: usize, mem: *mut u8, mem_len: usize, dst: usize, pairs: *mut u32) -> bool {
+    ffi_return!(s, _wit_list_lower_batch(td, values, offsets, rows, mem, mem_len, dst, pairs))
+}
+fn _wit_list_lower_batch(td: *const WITTypeDef, values: *const u8, offsets: *const u32, rows: usize, mem: *mut u8, mem_len: usize, dst: usize, pairs: *mut u32) -> Result<()> {
+    if td.is_null() || values.is_null() || offsets.is_null() || mem.is_null() || pairs.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let (img, td) = unsafe {
+        record(td)
+    };
+    let (size, align) = list_elem(img, td)?;
+    if dst % align != 0 {
+        return Err(wit_err!(InvalidArgument, "Invalid argument; destination is misaligned"))
+    }
+    let (offsets, pairs) = unsafe {
+        (std::slice::from_raw_parts(offsets, rows + 1), std::slice::from_raw_parts_mut(pairs, rows * 2))
+    };
+    let (first, last) = (offsets[0], offsets[rows]);
+    if last < first {
+        return Err(wit_err!(InvalidArgument, "Invalid argument; offsets must ascend"))
+    }
+    let bytes = (last - first) as usize * size;
+    let mem_len = mem_len.min(u32::MAX as usize + 1);
+    if dst > mem_len || bytes > mem_len - dst {
+        return Err(wit_err!(OutOfBounds, "Lists don't fit in linear memory"))
+    }
+    // Every row is checked before `pairs` is touched, so a failed call
+    // leaves it as it was.
+    if offsets.windows(2).any(|w| w[1] < w[0]) {
+        return Err(wit_err!(InvalidArgument, "Invalid argument; offsets must ascend"))
+    }
+    // Only an empty last row can start at the very end of a 4GiB memory,
+    // which a 32-bit pointer can't address.
+    if rows > 0 && dst + (offsets[rows - 1] - first) as usize * size > u32::MAX as usize {
+        return Err(wit_err!(OutOfBounds, "Lists don't fit in linear memory"))
+    }
+    for (i, pair) in pairs.chunks_exact_mut(2).enumerate() {
+        let (start, end) = (offsets[i], offsets[i + 1]);
+        pair[0] = (dst + (start - first) as usize * size) as u32;
+        pair[1] = end - start;
+    }
+    unsafe {
+        ptr::copy_nonoverlapping(values.add(first as usize * size), mem.add(dst), bytes);
+    }
+    Ok(())
+}
+
+// Lifts a column of lists (or strings) out of linear memory, from the
+// (ptr, len) pairs of `rows` rows.  The elements of every row are copied
+// back to back into `values`, which holds `cap` bytes, and `offsets` gets
+// `rows + 1` element offsets into it.  `len` is set to the bytes needed;
+// as with `wit_serialize`, if that is more than `cap` nothing is copied.
+#[no_mangle]
+pub extern "C" fn wit_list_lift_batch(s: *mut WITSession, td: *const WITTypeDef, mem: *const u8, mem_len: usize, pairs: *const u32, rows: usize, values: *mut u8, cap: usize, offsets: *mut u32, len: *mut usize) -> bool {
+    ffi_return!(s, _wit_list_lift_batch(td, mem, mem_len, pairs, rows, values, cap, offsets, len))
+}
+fn _wit_list_lift_batch(td: *const WITTypeDef, mem: *const u8, mem_len: usize, pairs: *const u32, rows: usize, values: *mut u8, cap: usize, offsets: *mut u32, len: *mut usize) -> Result<()> {
+    if td.is_null() || mem.is_null() || pairs.is_null() || (values.is_null() && cap > 0) ||
+       offsets.is_null() || len.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let (img, td) = unsafe {
+        record(td)
+    };
+    let (size, _) = list_elem(img, td)?;
+    let pairs = unsafe {
+        std::slice::from_raw_parts(pairs, rows * 2)
+    };
+    let mut total: u64 = 0;
+    for pair in pairs.chunks_exact(2) {
+        let (start, bytes) = (pair[0] as u64, pair[1] as u64 * size as u64);
+        if start + bytes > mem_len as u64 {
+            return Err(wit_err!(OutOfBounds, "List lies outside linear memory"))
+        }
+        total += bytes;
+    }
+    if total > u32::MAX as u64 * size as u64 {
+        return Err(wit_err!(OutOfBounds, "Lists too long for 32-bit offsets"))
+    }
+    unsafe {
+        *len = total as usize;
+    }
+    if total > cap as u64 {
+        return Ok(())
+    }
+    let offsets = unsafe {
+        std::slice::from_raw_parts_mut(offsets, rows + 1)
+    };
+    let mut at = 0;
+    offsets[0] = 0;
+    for (i, pair) in pairs.chunks_exact(2).enumerate() {
+        let bytes = pair[1] as usize * size;
+        // `values` may be NULL when every row is empty.
+        if bytes > 0 {
+            unsafe {
+                ptr::copy_nonoverlapping(mem.add(pair[0] as usize), values.add(at), bytes);
+            }
+        }
+        at += bytes;
+        offsets[i + 1] = u32::try_from(at / size)
+            .map_err(|_| wit_err!(OutOfBounds, "Lists too long for 32-bit offsets"))?;
+    }
+    Ok(())
+}
+
+// Checks that `td` is a record, or an alias of one, and returns its image,
+// size and fields.
+fn record_fields<'a>(td: *const WITTypeDef) -> Result<(ImageRef<'a>, usize, &'a [WITTypeDef])> {
+    let (img, td) = unsafe {
+        record(td)
+    };
+    let td = td.resolved(img);
+    if td.kind(img) == WITType::Record {
+        Ok((img, td.rec(img).size as usize, td.members(img)))
+    } else {
+        Err(wit_err!(WrongType, "Invalid parameter.  Must be record type!"))
+    }
+}
+
+// Packs `rows` records into `out`, which holds `rows` times the record's
+// size.  `columns` has one column per field, in field order, each holding
+// `rows` values in canonical form back to back.  Columns of unit fields
+// are ignored and may be NULL.
+#[no_mangle]
+pub extern "C" fn wit_record_lower_batch(s: *mut WITSession, td: *const WITTypeDef, columns: *const *const u8, rows: usize, out: *mut u8) -> bool {
+    ffi_return!(s, _wit_record_lower_batch(td, columns, rows, out))
+}
+fn _wit_record_lower_batch(td: *const WITTypeDef, columns: *const *const u8, rows: usize, out: *mut u8) -> Result<()> {
+    if td.is_null() || columns.is_null() || out.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let (img, size, fields) = record_fields(td)?;
+    let columns = unsafe {
+        std::slice::from_raw_parts(columns, fields.len())
+    };
+    for (field, col) in fields.iter().zip(columns) {
+        let fsize = field.rec(img).size as usize;
+        if fsize > 0 && col.is_null() {
+            return Err(wit_err!(InvalidArgument, "Invalid argument; missing column"))
+        }
+    }
+    for (field, col) in fields.iter().zip(columns) {
+        let fsize = field.rec(img).size as usize;
+        unsafe {
+            strided_copy(*col, fsize, out.add(field.offset as usize), size, fsize, rows);
+        }
+    }
+    Ok(())
+}
+
+// Unpacks `rows` records from `recs` into one column per field, the
+// reverse of `wit_record_lower_batch`.
+#[no_mangle]
+pub extern "C" fn wit_record_lift_batch(s: *mut WITSession, td: *const WITTypeDef, recs: *const u8, rows: usize, columns: *const *mut u8) -> bool {
+    ffi_return!(s, _wit_record_lift_batch(td, recs, rows, columns))
+}
+fn _wit_record_lift_batch(td: *const WITTypeDef, recs: *const u8, rows: usize, columns: *const *mut u8) -> Result<()> {
+    if td.is_null() || recs.is_null() || columns.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let (img, size, fields) = record_fields(td)?;
+    let columns = unsafe {
+        std::slice::from_raw_parts(columns, fields.len())
+    };
+    for (field, col) in fields.iter().zip(columns) {
+        let fsize = field.rec(img).size as usize;
+        if fsize > 0 && col.is_null() {
+            return Err(wit_err!(InvalidArgument, "Invalid argument; missing column"))
+        }
+    }
+    for (field, col) in fields.iter().zip(columns) {
+        let fsize = field.rec(img).size as usize;
+        unsafe {
+            strided_copy(recs.add(field.offset as usize), size, *col, fsize, fsize, rows);
+        }
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::WIT;
+    use crate::error::WITErrorCode;
+
+    const SPEC: &str = "\
+record row {
+    id: u32,
+    score: float64,
+    tags: list<u16>,
+}
+
+type tag-list = list<u16>
+
+load: func(r: row, t: tag-list) -> u32
+";
+
+    // A param of the spec's one function, as the FFI would hand it out.
+    fn param(wit: &WIT, idx: usize) -> *const WITTypeDef {
+        let img = wit.image.view();
+        img.handle(&img.main_funcs()[0].params(img)[idx])
+    }
+
+    #[test]
+    fn lists_round_trip() {
+        let wit = WIT::new(SPEC, None).unwrap();
+        let tags = param(&wit, 1);
+        let values: Vec<u16> = (0..10).collect();
+        let offsets = [0u32, 3, 3, 10];
+        let mut mem = vec![0u8; 64];
+        let mut pairs = [0u32; 6];
+        _wit_list_lower_batch(tags, values.as_ptr() as *const u8, offsets.as_ptr(), 3, mem.as_mut_ptr(), mem.len(), 8, pairs.as_mut_ptr()).unwrap();
+        assert_eq!(pairs, [8, 3, 14, 0, 14, 7]);
+
+        let mut out = vec![0u16; 10];
+        let mut out_offsets = [0u32; 4];
+        let mut len = 0;
+        _wit_list_lift_batch(tags, mem.as_ptr(), mem.len(), pairs.as_ptr(), 3, out.as_mut_ptr() as *mut u8, 20, out_offsets.as_mut_ptr(), &mut len).unwrap();
+        assert_eq!(len, 20);
+        assert_eq!(out, values);
+        assert_eq!(out_offsets, offsets);
+    }
+
+    #[test]
+    fn failed_list_lower_leaves_pairs() {
+        let wit = WIT::new(SPEC, None).unwrap();
+        let tags = param(&wit, 1);
+        let values = [0u16; 10];
+        let mut mem = vec![0u8; 64];
+        let mut pairs = [7u32; 6];
+        let res = _wit_list_lower_batch(tags, values.as_ptr() as *const u8, [0u32, 3, 2, 10].as_ptr(), 3, mem.as_mut_ptr(), mem.len(), 0, pairs.as_mut_ptr());
+        assert_eq!(res.err().map(|e| e.code()), Some(WITErrorCode::InvalidArgument));
+        let res = _wit_list_lower_batch(tags, values.as_ptr() as *const u8, [0u32, 3, 10].as_ptr(), 2, mem.as_mut_ptr(), 16, 0, pairs.as_mut_ptr());
+        assert_eq!(res.err().map(|e| e.code()), Some(WITErrorCode::OutOfBounds));
+        assert_eq!(pairs, [7; 6]);
+        assert!(mem.iter().all(|b| *b == 0));
+    }
+
+    #[test]
+    fn empty_lists_lift_without_values() {
+        let wit = WIT::new(SPEC, None).unwrap();
+        let tags = param(&wit, 1);
+        let mem = [0u8; 8];
+        let pairs = [0u32, 0, 8, 0];
+        let mut offsets = [9u32; 3];
+        let mut len = 1;
+        _wit_list_lift_batch(tags, mem.as_ptr(), mem.len(), pairs.as_ptr(), 2, ptr::null_mut(), 0, offsets.as_mut_ptr(), &mut len).unwrap();
+        assert_eq!(len, 0);
+        assert_eq!(offsets, [0; 3]);
+    }
+
+    #[test]
+    fn records_round_trip() {
+        let wit = WIT::new(SPEC, None).unwrap();
+        let row = param(&wit, 0);
+        let ids = [1u32, 2, 3];
+        let scores = [0.5f64, -1.0, 2.25];
+        let tags = [8u32, 3, 14, 0, 14, 7];
+        let columns = [ids.as_ptr() as *const u8, scores.as_ptr() as *const u8, tags.as_ptr() as *const u8];
+        let mut recs = vec![0u8; 3 * 24];
+        _wit_record_lower_batch(row, columns.as_ptr(), 3, recs.as_mut_ptr()).unwrap();
+        assert_eq!(recs[24..28], 2u32.to_ne_bytes());
+        assert_eq!(recs[32..40], (-1.0f64).to_ne_bytes());
+        assert_eq!(recs[40..48], [14u32.to_ne_bytes(), 0u32.to_ne_bytes()].concat()[..]);
+
+        let (mut ids_out, mut scores_out, mut tags_out) = ([0u32; 3], [0f64; 3], [0u32; 6]);
+        let columns = [ids_out.as_mut_ptr() as *mut u8, scores_out.as_mut_ptr() as *mut u8, tags_out.as_mut_ptr() as *mut u8];
+        _wit_record_lift_batch(row, recs.as_ptr(), 3, columns.as_ptr()).unwrap();
+        assert_eq!(ids_out, ids);
+        assert_eq!(scores_out, scores);
+        assert_eq!(tags_out, tags);
+    }
+}
@@ -0,0 +1,511 @@
+// Call plans: how each function's WIT params and result map onto its core
+// signature, worked out once when the spec is compiled.  A plan is a flat
+// run of steps, one per core value a param or the result lowers to, and
+// says where the value goes (a slot of the signature, or an offset into
+// the indirect params or return area) and how to convert it, so a call
+// stub can be generated without re-deriving the canonical ABI rules from
+// the types.
+//
+// Steps come in the order the values are flattened.  A variant-like
+// value has a step for its tag, followed by the steps of every case's
+// payload; each of those names the tag step it depends on and the case it
+// belongs to, so a stub can select them with a compare rather than by
+// walking the case's type.  Slots of a variant's payload that the chosen
+// case doesn't use are zero.
+//
+// The same plan serves both ABI variants.  Which parts are indirect
+// doesn't depend on the variant, only where the pointer to the memory
+// goes: the first param for indirect params, and for an indirect result,
+// the first result of an export or the last param of an import.
+
+use std::collections::HashMap;
+use std::mem::size_of;
+
+use crate::{TypeRec, WITFunction, WITSession, WITSigPart, WITSignature, WITType, WITTypeDef, WASMType, record};
+use crate::error::{Result, check};
+#[cfg(feature="catch_panics")]
+use crate::error::{WITErr, WITErrorCode, error_set};
+#[cfg(feature="catch_panics")]
+use std::panic::{catch_unwind, AssertUnwindSafe};
+
+// The canonical ABI's limits on flattened params and results.
+const MAX_FLAT_PARAMS:  usize = 16;
+const MAX_FLAT_RESULTS: usize = 1;
+
+// The `guard` of a step that applies whatever the tags hold.
+pub(crate) const NO_GUARD: u32 = u32::MAX;
+
+// The `plan_first` of a function left without a plan, because the one
+// worked out for it didn't match the parser's signature.
+pub(crate) const NO_PLAN: u32 = u32::MAX;
+
+#[derive(Clone, Copy, PartialEq)]
+#[repr(C)]
+pub enum WITPlanLoc {
+    Slot,       // `at` is an index into the part of the signature
+    Memory,     // `at` is a byte offset into the part's memory
+}
+
+// How a value of `width` bytes becomes a core value of type `core`, or the
+// reverse when lifting.
+#[derive(Clone, Copy, PartialEq)]
+#[repr(C)]
+pub enum WITPlanOp {
+    Copy,           // Same bits
+    ZeroExtend,     // Unsigned integer, zero-extended
+    SignExtend,     // Signed integer, sign-extended to 32 bits, then zero-extended
+    FloatBits,      // A float's bits as an integer, zero-extended
+}
+
+// One core value of a param or the result.  Its path is `path_len` member
+// indices in the function's path pool, starting at `path`: for a param,
+// the param's index and then a member index for each field, case or
+// payload on the way down to the value; for the result, just the member
+// indices.  Aliases add nothing to a path.
+//
+// A tag step's `kind` is that of its variant, enum, option, ... type.
+// Other steps' `kind` is the type of the value, and a list or string has
+// two steps: its pointer (`word` 0) and its length (`word` 1).
+#[repr(C)]
+pub struct WITPlanStep {
+    pub part:     WITSigPart,
+    pub path:     u32,
+    pub path_len: u32,
+    pub kind:     WITType,
+    pub word:     u32,          // Which core value of a list, string or flags value
+    pub loc:      WITPlanLoc,
+    pub at:       u32,
+    pub width:    u32,          // Size of the value in bytes
+    pub core:     WASMType,
+    pub op:       WITPlanOp,
+    pub guard:    u32,          // Index of the tag step this depends on, or UINT32_MAX
+    pub when:     u32,          // Value of that tag under which it applies
+}
+
+// `WITPlanStep` as stored, before its enums are known to be in range.
+#[repr(C)]
+pub(crate) struct RawStep {
+    part:     u32,
+    path:     u32,
+    path_len: u32,
+    kind:     u32,
+    word:     u32,
+    loc:      u32,
+    at:       u32,
+    width:    u32,
+    core:     u32,
+    op:       u32,
+    guard:    u32,
+    when:     u32,
+}
+
+const _: () = assert!(size_of::<RawStep>() == size_of::<WITPlanStep>());
+
+// Checks a function's stored plan: every enum in range, paths in the pool,
+// guards naming earlier steps and slots within the signature.
+pub(crate) fn plan_ok(steps: &[RawStep], npaths: usize, sig: &WITSignature) -> bool {
+    steps.iter().enumerate().all(|(i, st)| {
+        let slots = if st.part == WITSigPart::Params as u32 { sig.params_len } else { sig.results_len };
+        st.part <= WITSigPart::Results as u32 &&
+            st.path as u64 + st.path_len as u64 <= npaths as u64 &&
+            WITType::from_u32(st.kind).is_some() &&
+            st.loc <= WITPlanLoc::Memory as u32 &&
+            (st.loc != WITPlanLoc::Slot as u32 || st.at < slots) &&
+            st.core <= WASMType::F64 as u32 &&
+            st.op <= WITPlanOp::FloatBits as u32 &&
+            (st.guard == NO_GUARD || (st.guard as usize) < i)
+    })
+}
+
+// The core type a value of the given kind lowers to before any join.
+fn natural(kind: WITType) -> WASMType {
+    match kind {
+        WITType::U64 | WITType::S64 => WASMType::I64,
+        WITType::Float32 => WASMType::F32,
+        WITType::Float64 => WASMType::F64,
+        _ => WASMType::I32,
+    }
+}
+
+fn core_size(t: WASMType) -> u32 {
+    match t {
+        WASMType::I32 | WASMType::F32 => 4,
+        WASMType::I64 | WASMType::F64 => 8,
+    }
+}
+
+// The canonical ABI's join of two slot types shared by variant cases.
+fn join(a: WASMType, b: WASMType) -> WASMType {
+    match (a, b) {
+        (a, b) if a == b => a,
+        (WASMType::I32, WASMType::F32) | (WASMType::F32, WASMType::I32) => WASMType::I32,
+        _ => WASMType::I64,
+    }
+}
+
+fn op_for(kind: WITType, width: u32, core: WASMType) -> WITPlanOp {
+    let nat = natural(kind);
+    match nat {
+        WASMType::F32 | WASMType::F64 if nat != core => WITPlanOp::FloatBits,
+        WASMType::I32 if kind == WITType::S8 || kind == WITType::S16 => WITPlanOp::SignExtend,
+        _ if width < core_size(core) => WITPlanOp::ZeroExtend,
+        _ => WITPlanOp::Copy,
+    }
+}
+
+// Builds plans over the type table and typedefs of an image being
+// compiled.
+pub(crate) struct PlanBuilder<'a> {
+    types:     &'a [TypeRec],
+    typedefs:  &'a [WITTypeDef],
+    pub(crate) steps: Vec<WITPlanStep>,
+    pub(crate) paths: Vec<u32>,
+    path:      Vec<u32>,            // Path of the value being visited
+    first:     usize,               // First step of the current function
+    core:      Vec<WASMType>,       // Slot types of the part being planned
+    shapes:    HashMap<Vec<u32>, u32>,  // Id of each distinct shape
+    shape_of:  Vec<u32>,                // Shape of each type, once known
+    plans:     HashMap<Vec<u32>, (u32, u32)>,   // Plan of each distinct signature
+    key:       Vec<u32>,            // Signature being looked up in `plans`
+}
+
+const NO_SHAPE: u32 = u32::MAX;
+
+impl<'a> PlanBuilder<'a> {
+    pub(crate) fn new(types: &'a [TypeRec], typedefs: &'a [WITTypeDef]) -> PlanBuilder<'a> {
+        PlanBuilder {
+            types,
+            typedefs,
+            steps: Vec::new(),
+            paths: Vec::new(),
+            path:  Vec::new(),
+            first: 0,
+            core:  Vec::new(),
+            shapes:   HashMap::new(),
+            shape_of: vec![NO_SHAPE; types.len()],
+            plans:    HashMap::new(),
+            key:      Vec::new(),
+        }
+    }
+
+    fn members(&self, rec: &TypeRec) -> &'a [WITTypeDef] {
+        &self.typedefs[rec.first as usize..(rec.first + rec.count) as usize]
+    }
+
+    // Looks through aliases.
+    fn resolve(&self, mut ty: u32) -> &'a TypeRec {
+        loop {
+            let rec = &self.types[ty as usize];
+            if rec.kind() != WITType::Type {
+                return rec;
+            }
+            ty = rec.elem;
+        }
+    }
+
+    // Numbers types by everything a plan depends on -- kind, layout and
+    // the shapes of their members -- so that types that can only have the
+    // same plan get the same id.  Names don't matter, and aliases have the
+    // shape of what they alias.
+    fn shape(&mut self, ty: u32) -> u32 {
+        let rec = self.resolve(ty);
+        let idx = (rec as *const TypeRec as usize - self.types.as_ptr() as usize) / size_of::<TypeRec>();
+        if self.shape_of[idx] != NO_SHAPE {
+            return self.shape_of[idx];
+        }
+        let mut key = vec![rec.kind, rec.size, rec.align, rec.tag, rec.count];
+        for m in self.members(rec) {
+            key.push(m.offset);
+            key.push(self.shape(m.ty));
+        }
+        if rec.kind() == WITType::List || rec.kind() == WITType::Stream {
+            key.push(self.shape(rec.elem));
+        }
+        let next = self.shapes.len() as u32;
+        let shape = *self.shapes.entry(key).or_insert(next);
+        self.shape_of[idx] = shape;
+        shape
+    }
+
+    fn flags_words(rec: &TypeRec) -> u32 {
+        ((rec.count + 31) / 32).max(1)
+    }
+
+    // Appends the core types a type flattens to.
+    fn flatten(&self, ty: u32, out: &mut Vec<WASMType>) {
+        let rec = self.resolve(ty);
+        match rec.kind() {
+            WITType::Unit => {},
+            WITType::String | WITType::List => out.extend([WASMType::I32, WASMType::I32]),
+            WITType::Flags => out.extend((0..Self::flags_words(rec)).map(|_| WASMType::I32)),
+            WITType::Record | WITType::Tuple => {
+                for m in self.members(rec) {
+                    self.flatten(m.ty, out);
+                }
+            },
+            WITType::Variant | WITType::Union | WITType::Option | WITType::Expected => {
+                out.push(WASMType::I32);
+                let start = out.len();
+                let mut case = Vec::new();
+                for m in self.members(rec) {
+                    case.clear();
+                    self.flatten(m.ty, &mut case);
+                    for (i, t) in case.iter().enumerate() {
+                        match out.get_mut(start + i) {
+                            Some(slot) => *slot = join(*slot, *t),
+                            None => out.push(*t),
+                        }
+                    }
+                }
+            },
+            kind => out.push(natural(kind)),
+        }
+    }
+
+    fn push(&mut self, part: WITSigPart, kind: WITType, word: u32, loc: WITPlanLoc, at: u32,
+            width: u32, core: WASMType, guard: u32, when: u32) -> u32 {
+        let path = self.paths.len() as u32;
+        self.paths.extend_from_slice(&self.path);
+        self.steps.push(
+            WITPlanStep {
+                part,
+                path,
+                path_len: self.path.len() as u32,
+                kind,
+                word,
+                loc,
+                at,
+                width,
+                core,
+                op: op_for(kind, width, core),
+                guard,
+                when,
+            }
+        );
+        (self.steps.len() - 1 - self.first) as u32
+    }
+
+    // The discriminant of each member of a variant-like type.  An option's
+    // one member is its `some` case.
+    fn when_of(rec: &TypeRec, member: usize) -> u32 {
+        if rec.kind() == WITType::Option { 1 } else { member as u32 }
+    }
+
+    // Plans a value passed in slots, starting at `*slot`.
+    fn slots(&mut self, part: WITSigPart, ty: u32, slot: &mut u32, guard: u32, when: u32) {
+        let rec = self.resolve(ty);
+        let kind = rec.kind();
+        match kind {
+            WITType::Unit => {},
+            WITType::String | WITType::List => {
+                for word in 0..2 {
+                    self.push(part, kind, word, WITPlanLoc::Slot, *slot, 4, self.core[*slot as usize], guard, when);
+                    *slot += 1;
+                }
+            },
+            WITType::Flags => {
+                let words = Self::flags_words(rec);
+                let width = if words == 1 { rec.size.min(4) } else { 4 };
+                for word in 0..words {
+                    self.push(part, kind, word, WITPlanLoc::Slot, *slot, width, self.core[*slot as usize], guard, when);
+                    *slot += 1;
+                }
+            },
+            WITType::Record | WITType::Tuple => {
+                for (i, m) in self.members(rec).iter().enumerate() {
+                    self.path.push(i as u32);
+                    self.slots(part, m.ty, slot, guard, when);
+                    self.path.pop();
+                }
+            },
+            WITType::Variant | WITType::Union | WITType::Option | WITType::Expected => {
+                let tag = self.push(part, kind, 0, WITPlanLoc::Slot, *slot, rec.tag, self.core[*slot as usize], guard, when);
+                *slot += 1;
+                let payload = *slot;
+                let mut end = payload;
+                for (i, m) in self.members(rec).iter().enumerate() {
+                    let mut at = payload;
+                    self.path.push(i as u32);
+                    self.slots(part, m.ty, &mut at, tag, Self::when_of(rec, i));
+                    self.path.pop();
+                    end = end.max(at);
+                }
+                *slot = end;
+            },
+            WITType::Enum => {
+                self.push(part, kind, 0, WITPlanLoc::Slot, *slot, rec.tag, self.core[*slot as usize], guard, when);
+                *slot += 1;
+            },
+            _ => {
+                self.push(part, kind, 0, WITPlanLoc::Slot, *slot, rec.size, self.core[*slot as usize], guard, when);
+                *slot += 1;
+            },
+        }
+    }
+
+    // Plans a value stored in memory at byte offset `at`.
+    fn memory(&mut self, part: WITSigPart, ty: u32, at: u32, guard: u32, when: u32) {
+        let rec = self.resolve(ty);
+        let kind = rec.kind();
+        match kind {
+            WITType::Unit => {},
+            WITType::String | WITType::List => {
+                for word in 0..2 {
+                    self.push(part, kind, word, WITPlanLoc::Memory, at + 4 * word, 4, WASMType::I32, guard, when);
+                }
+            },
+            WITType::Flags => {
+                let words = Self::flags_words(rec);
+                let width = if words == 1 { rec.size.min(4) } else { 4 };
+                for word in 0..words {
+                    self.push(part, kind, word, WITPlanLoc::Memory, at + 4 * word, width, WASMType::I32, guard, when);
+                }
+            },
+            WITType::Record | WITType::Tuple => {
+                for (i, m) in self.members(rec).iter().enumerate() {
+                    self.path.push(i as u32);
+                    self.memory(part, m.ty, at + m.offset, guard, when);
+                    self.path.pop();
+                }
+            },
+            WITType::Variant | WITType::Union | WITType::Option | WITType::Expected => {
+                let tag = self.push(part, kind, 0, WITPlanLoc::Memory, at, rec.tag, WASMType::I32, guard, when);
+                for (i, m) in self.members(rec).iter().enumerate() {
+                    self.path.push(i as u32);
+                    self.memory(part, m.ty, at + m.offset, tag, Self::when_of(rec, i));
+                    self.path.pop();
+                }
+            },
+            WITType::Enum => {
+                self.push(part, kind, 0, WITPlanLoc::Memory, at, rec.tag, WASMType::I32, guard, when);
+            },
+            _ => {
+                self.push(part, kind, 0, WITPlanLoc::Memory, at, rec.size, natural(kind), guard, when);
+            },
+        }
+    }
+
+    // Plans one function, returning the range of its steps.  The slot
+    // types worked out along the way, and which parts go through memory,
+    // must match the parser's signature; if they don't, the function gets
+    // no plan rather than a wrong one, and whatever was built for it is
+    // dropped again.
+    pub(crate) fn func(&mut self, params: &[WITTypeDef], result: u32, sig: &WITSignature, wasm: &[u32]) -> Option<(u32, u32)> {
+        // Functions whose params and result have the same shapes have the
+        // same plan, which is only built and stored once.
+        // The key is only copied for a plan that's new.
+        let mut key = std::mem::take(&mut self.key);
+        key.clear();
+        for p in params {
+            key.push(self.shape(p.ty));
+        }
+        key.push(self.shape(result));
+        let found = self.plans.get(&key[..]).copied();
+        self.key = key;
+        if let Some(plan) = found {
+            return Some(plan);
+        }
+        self.first = self.steps.len();
+        let npaths = self.paths.len();
+        let mismatch = |pb: &mut Self| {
+            pb.steps.truncate(pb.first);
+            pb.paths.truncate(npaths);
+            None
+        };
+
+        let mut core = Vec::new();
+        for p in params {
+            self.flatten(p.ty, &mut core);
+        }
+        // Whether a part goes through memory is the parser's call as much
+        // as the slot types are.
+        if (core.len() > MAX_FLAT_PARAMS) != (sig.indirect_params != 0) {
+            return mismatch(self);
+        }
+        if core.len() > MAX_FLAT_PARAMS {
+            // Params are stored as if they were the fields of a tuple.
+            let mut off = 0;
+            for (i, p) in params.iter().enumerate() {
+                let rec = &self.types[p.ty as usize];
+                off = (off + rec.align - 1) & !(rec.align - 1);
+                self.path.push(i as u32);
+                self.memory(WITSigPart::Params, p.ty, off, NO_GUARD, 0);
+                self.path.pop();
+                off += rec.size;
+            }
+        } else {
+            let sig_params = &wasm[sig.params as usize..][..sig.params_len as usize];
+            if !core.iter().map(|t| *t as u32).eq(sig_params.iter().copied()) {
+                return mismatch(self);
+            }
+            self.core = core;
+            let mut slot = 0;
+            for (i, p) in params.iter().enumerate() {
+                self.path.push(i as u32);
+                self.slots(WITSigPart::Params, p.ty, &mut slot, NO_GUARD, 0);
+                self.path.pop();
+            }
+        }
+
+        let mut core = Vec::new();
+        self.flatten(result, &mut core);
+        if (core.len() > MAX_FLAT_RESULTS) != (sig.retptr != 0) {
+            return mismatch(self);
+        }
+        if core.len() > MAX_FLAT_RESULTS {
+            self.memory(WITSigPart::Results, result, 0, NO_GUARD, 0);
+        } else {
+            let sig_results = &wasm[sig.results as usize..][..sig.results_len as usize];
+            if !core.iter().map(|t| *t as u32).eq(sig_results.iter().copied()) {
+                return mismatch(self);
+            }
+            self.core = core;
+            self.slots(WITSigPart::Results, result, &mut 0, NO_GUARD, 0);
+        }
+        let plan = (self.first as u32, (self.steps.len() - self.first) as u32);
+        self.plans.insert(self.key.clone(), plan);
+        Some(plan)
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Gets a function's call plan, which lives as long as its WIT.  Fails
+// with `NotFound` for a function whose plan couldn't be worked out.
+#[no_mangle]
+pub extern "C" fn wit_func_plan_get(s: *mut WITSession, func: *const WITFunction, res: *mut *const WITPlanStep, len: *mut usize) -> bool {
+    ffi_return!(s, _wit_func_plan_get(func, res, len))
+}
+fn _wit_func_plan_get(func: *const WITFunction, res: *mut *const WITPlanStep, len: *mut usize) -> Result<()> {
+    if func.is_null() || res.is_null() || len.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let (img, func) = unsafe {
+        record(func)
+    };
+    let plan = func.plan(img).ok_or_else(|| wit_err!(NotFound, "Function has no call plan"))?;
+    unsafe {
+        *res = plan.as_ptr();
+        *len = plan.len();
+    }
+    Ok(())
+}
+
+// Returns the base of the path pool the steps of a function's plan refer
+// to.  A step's path is the `path_len` indices at `paths + path`.
+#[no_mangle]
+pub extern "C" fn wit_func_plan_paths_get(s: *mut WITSession, func: *const WITFunction, res: *mut *const u32) -> bool {
+    ffi_return!(s, _wit_func_plan_paths_get(func, res))
+}
+fn _wit_func_plan_paths_get(func: *const WITFunction, res: *mut *const u32) -> Result<()> {
+    if func.is_null() || res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let (img, _) = unsafe {
+        record(func)
+    };
+    unsafe {
+        *res = img.paths().as_ptr();
+    }
+    Ok(())
+}
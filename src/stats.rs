@@ -0,0 +1,125 @@
+// Instrumentation (`stats` feature only): counts of what each session's
+// calls build, and how long parsing spends in each phase.
+//
+// Internals add to a per-thread tally as they go, without knowing which
+// session they are working for.  When an FFI call returns, its tally is
+// moved into the session it was passed, or, for a NULL session, into a
+// per-thread total, just as errors are.
+//
+// The header declares what this module exports under `TO_WIT_STATS` (see
+// cbindgen.toml), so C++ callers see it only if they ask for it.
+
+use std::cell::Cell;
+use std::ptr;
+
+use crate::WITSession;
+use crate::error::{Result, check};
+#[cfg(feature="catch_panics")]
+use crate::error::{WITErr, WITErrorCode, error_set};
+#[cfg(feature="catch_panics")]
+use std::panic::{catch_unwind, AssertUnwindSafe};
+
+#[derive(Clone, Copy, Default)]
+#[repr(C)]
+pub struct WITStats {
+    pub parses:          u64,   // Specs parsed
+    pub typedefs:        u64,   // Typedef records built
+    pub names:           u64,   // Distinct names interned
+    pub name_bytes:      u64,
+    pub iters:           u64,   // Iterators allocated by the `*_walk` calls
+    pub iters_in_place:  u64,   // Iterators built by the `*_walk_in` calls
+    pub error_strings:   u64,   // Error messages formatted
+    pub bytes_allocated: u64,   // By images, iterators and error messages
+    pub parse_ns:        u64,   // Parsing the text
+    pub size_ns:         u64,   // Working out sizes and alignments
+    pub build_ns:        u64,   // Building the image
+}
+impl WITStats {
+    fn merge(&mut self, o: &WITStats) {
+        self.parses          += o.parses;
+        self.typedefs        += o.typedefs;
+        self.names           += o.names;
+        self.name_bytes      += o.name_bytes;
+        self.iters           += o.iters;
+        self.iters_in_place  += o.iters_in_place;
+        self.error_strings   += o.error_strings;
+        self.bytes_allocated += o.bytes_allocated;
+        self.parse_ns        += o.parse_ns;
+        self.size_ns         += o.size_ns;
+        self.build_ns        += o.build_ns;
+    }
+}
+
+thread_local! {
+    static PENDING: Cell<WITStats> = Cell::new(WITStats::default());
+    static THREAD_STATS: Cell<WITStats> = Cell::new(WITStats::default());
+}
+
+// Adds to the calling thread's tally for the current call.
+pub(crate) fn add(f: impl FnOnce(&mut WITStats)) {
+    PENDING.with(|p| {
+        let mut st = p.get();
+        f(&mut st);
+        p.set(st);
+    })
+}
+
+// Takes the calling thread's tally, e.g. to hand it from a worker thread
+// to the thread that made the call.
+pub(crate) fn take() -> WITStats {
+    PENDING.with(|p| p.take())
+}
+
+pub(crate) fn merge(st: WITStats) {
+    add(|p| p.merge(&st))
+}
+
+// Moves the current call's tally into the totals for `s`.
+pub(crate) fn flush(s: *mut WITSession) {
+    let st = take();
+    if s.is_null() {
+        THREAD_STATS.with(|t| {
+            let mut total = t.get();
+            total.merge(&st);
+            t.set(total);
+        })
+    } else {
+        unsafe {
+            (*s).stats.merge(&st);
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Copies the totals for a session (or, given NULL, for calls the calling
+// thread made without one) into `res`.
+#[no_mangle]
+pub extern "C" fn wit_session_stats_get(s: *mut WITSession, res: *mut WITStats) -> bool {
+    ffi_return!(s, _wit_session_stats_get(s, res))
+}
+fn _wit_session_stats_get(s: *mut WITSession, res: *mut WITStats) -> Result<()> {
+    if res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let st = if s.is_null() {
+        THREAD_STATS.with(|t| t.get())
+    } else {
+        unsafe { (*s).stats }
+    };
+    unsafe {
+        ptr::write(res, st);
+    }
+    Ok(())
+}
+
+#[no_mangle]
+pub extern "C" fn wit_session_stats_clear(s: *mut WITSession) {
+    if s.is_null() {
+        THREAD_STATS.with(|t| t.set(WITStats::default()))
+    } else {
+        unsafe {
+            (*s).stats = WITStats::default();
+        }
+    }
+}
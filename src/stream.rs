@@ -0,0 +1,139 @@
+// Push-style parsing, for specs that arrive in pieces, e.g. over the
+// network.
+//
+// The parser itself needs the whole text, so chunks are gathered into one
+// buffer owned by the `WITParser`, in place of the copy the caller would
+// otherwise have to build.  The work that can be done a chunk at a time
+// is: checking UTF-8 (a character split across chunks is finished by the
+// next one) and hashing the source.  `wit_parser_finish` then parses
+// without going over the text again for either.
+
+use std::mem;
+use std::slice;
+use std::str;
+
+use crate::{WIT, WITSession};
+use crate::alloc::{Allocator, delete_handle, hooks_of, new_handle};
+use crate::error::{Result, check};
+use crate::image::{SOURCE_HASH_START, source_hash_more};
+#[cfg(feature="catch_panics")]
+use crate::error::{WITErr, WITErrorCode, error_set};
+#[cfg(feature="catch_panics")]
+use std::panic::{catch_unwind, AssertUnwindSafe};
+
+pub struct WITParser {
+    text:    Vec<u8>,
+    checked: usize,     // Length of the prefix known to be valid UTF-8
+    hash:    u64,       // `source_hash` of `text` so far
+    bad:     bool,      // Some chunk wasn't valid UTF-8
+}
+
+impl WITParser {
+    fn new(size_hint: usize) -> WITParser {
+        WITParser {
+            text:    Vec::with_capacity(size_hint),
+            checked: 0,
+            hash:    SOURCE_HASH_START,
+            bad:     false,
+        }
+    }
+
+    fn feed(&mut self, chunk: &[u8]) -> Result<()> {
+        if self.bad {
+            return Err(wit_err!(Parse, "Spec is not valid UTF-8"));
+        }
+        self.text.extend_from_slice(chunk);
+        self.hash = source_hash_more(self.hash, chunk);
+        // Only the tail of the last chunk can still be unchecked.
+        match str::from_utf8(&self.text[self.checked..]) {
+            Ok(_) => self.checked = self.text.len(),
+            Err(e) if e.error_len().is_none() => self.checked += e.valid_up_to(),
+            Err(_) => {
+                self.bad = true;
+                return Err(wit_err!(Parse, "Spec is not valid UTF-8"));
+            },
+        }
+        Ok(())
+    }
+
+    fn finish(self, alloc: Option<Allocator>) -> Result<WIT> {
+        if self.bad || self.checked != self.text.len() {
+            return Err(wit_err!(Parse, "Spec is not valid UTF-8"));
+        }
+        let text = unsafe { str::from_utf8_unchecked(&self.text) };
+        WIT::new_hashed(text, self.hash, alloc)
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Starts a push-style parse.  `size_hint` is the expected length of the
+// whole spec, if known, so the text is gathered without regrowing; pass 0
+// if not.
+#[no_mangle]
+pub extern "C" fn wit_parser_new(s: *mut WITSession, size_hint: usize, res: *mut *mut WITParser) -> bool {
+    ffi_return!(s, _wit_parser_new(hooks_of(s), size_hint, res))
+}
+fn _wit_parser_new(alloc: Option<Allocator>, size_hint: usize, res: *mut *mut WITParser) -> Result<()> {
+    if res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let safe_res = new_handle(alloc, WITParser::new(size_hint))?;
+    unsafe {
+        *res = safe_res;
+    }
+    Ok(())
+}
+
+// Adds the next chunk of the spec.  Chunks may split the text anywhere,
+// including inside a UTF-8 sequence.  Fails as soon as the text can't be
+// valid UTF-8, after which every call on the parser fails.
+#[no_mangle]
+pub extern "C" fn wit_parser_feed(s: *mut WITSession, parser: *mut WITParser, chunk: *const u8, len: usize) -> bool {
+    ffi_return!(s, _wit_parser_feed(parser, chunk, len))
+}
+fn _wit_parser_feed(parser: *mut WITParser, chunk: *const u8, len: usize) -> Result<()> {
+    if parser.is_null() || (chunk.is_null() && len != 0) {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let (parser, chunk) = unsafe {
+        (&mut *parser, if len == 0 { &[][..] } else { slice::from_raw_parts(chunk, len) })
+    };
+    parser.feed(chunk)
+}
+
+// Parses everything fed so far, as `wit_parse` would.  The parser is
+// deleted either way.
+#[no_mangle]
+pub extern "C" fn wit_parser_finish(s: *mut WITSession, parser: *mut WITParser, res: *mut *mut WIT) -> bool {
+    ffi_return!(s, _wit_parser_finish(hooks_of(s), parser, res))
+}
+fn _wit_parser_finish(alloc: Option<Allocator>, parser: *mut WITParser, res: *mut *mut WIT) -> Result<()> {
+    if parser.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let parser = unsafe {
+        let taken = mem::replace(&mut *parser, WITParser::new(0));
+        delete_handle(parser);
+        taken
+    };
+    if res.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let safe_res = new_handle(alloc, parser.finish(alloc)?)?;
+    unsafe {
+        *res = safe_res;
+    }
+    Ok(())
+}
+
+// Abandons a parse without finishing it.
+#[no_mangle]
+pub extern "C" fn wit_parser_delete(_s: *mut WITSession, parser: *mut WITParser) {
+    if parser.is_null() {
+        return;
+    }
+    unsafe {
+        delete_handle(parser);
+    }
+}
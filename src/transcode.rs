@@ -0,0 +1,302 @@
+// Transcoding between UTF-8 strings and `list<char>`, whose elements are
+// 32-bit Unicode scalar values.  Text is mostly ASCII, so both directions
+// check a block at a time for ASCII and widen or narrow the whole block at
+// once, falling back to one scalar at a time only around other characters.
+// Blocks are 16 bytes with SSE2 on x86-64 (where it is always available),
+// and 8 bytes through a 64-bit word elsewhere.
+
+use std::slice;
+use std::str;
+
+use crate::WITSession;
+use crate::error::{Result, check};
+#[cfg(feature="catch_panics")]
+use crate::error::{WITErr, WITErrorCode, error_set};
+#[cfg(feature="catch_panics")]
+use std::panic::{catch_unwind, AssertUnwindSafe};
+
+#[cfg(target_arch = "x86_64")]
+const BLOCK: usize = 16;
+#[cfg(not(target_arch = "x86_64"))]
+const BLOCK: usize = 8;
+
+// Widens `BLOCK` bytes of ASCII to scalars, or returns false without
+// writing anything if they aren't all ASCII.
+#[cfg(target_arch = "x86_64")]
+#[inline]
+unsafe fn widen_block(src: *const u8, dst: *mut u32) -> bool {
+    use std::arch::x86_64::*;
+    let v = _mm_loadu_si128(src as *const __m128i);
+    if _mm_movemask_epi8(v) != 0 {
+        return false;
+    }
+    let zero = _mm_setzero_si128();
+    let lo = _mm_unpacklo_epi8(v, zero);
+    let hi = _mm_unpackhi_epi8(v, zero);
+    let dst = dst as *mut __m128i;
+    _mm_storeu_si128(dst, _mm_unpacklo_epi16(lo, zero));
+    _mm_storeu_si128(dst.add(1), _mm_unpackhi_epi16(lo, zero));
+    _mm_storeu_si128(dst.add(2), _mm_unpacklo_epi16(hi, zero));
+    _mm_storeu_si128(dst.add(3), _mm_unpackhi_epi16(hi, zero));
+    true
+}
+
+#[cfg(not(target_arch = "x86_64"))]
+#[inline]
+unsafe fn widen_block(src: *const u8, dst: *mut u32) -> bool {
+    let word = std::ptr::read_unaligned(src as *const u64);
+    if word & 0x8080_8080_8080_8080 != 0 {
+        return false;
+    }
+    for i in 0..BLOCK {
+        *dst.add(i) = *src.add(i) as u32;
+    }
+    true
+}
+
+// Narrows `BLOCK` scalars to ASCII bytes, or returns false without writing
+// anything if they aren't all ASCII.
+#[cfg(target_arch = "x86_64")]
+#[inline]
+unsafe fn narrow_block(src: *const u32, dst: *mut u8) -> bool {
+    use std::arch::x86_64::*;
+    let src = src as *const __m128i;
+    let v0 = _mm_loadu_si128(src);
+    let v1 = _mm_loadu_si128(src.add(1));
+    let v2 = _mm_loadu_si128(src.add(2));
+    let v3 = _mm_loadu_si128(src.add(3));
+    let all = _mm_or_si128(_mm_or_si128(v0, v1), _mm_or_si128(v2, v3));
+    let high = _mm_and_si128(all, _mm_set1_epi32(!0x7f));
+    if _mm_movemask_epi8(_mm_cmpeq_epi8(high, _mm_setzero_si128())) != 0xffff {
+        return false;
+    }
+    let lo = _mm_packs_epi32(v0, v1);
+    let hi = _mm_packs_epi32(v2, v3);
+    _mm_storeu_si128(dst as *mut __m128i, _mm_packus_epi16(lo, hi));
+    true
+}
+
+#[cfg(not(target_arch = "x86_64"))]
+#[inline]
+unsafe fn narrow_block(src: *const u32, dst: *mut u8) -> bool {
+    let mut all = 0;
+    for i in 0..BLOCK {
+        all |= *src.add(i);
+    }
+    if all >= 0x80 {
+        return false;
+    }
+    for i in 0..BLOCK {
+        *dst.add(i) = *src.add(i) as u8;
+    }
+    true
+}
+
+// Decodes checked UTF-8 into `out`, which must have room for one scalar
+// per byte.  Returns the number of scalars.
+fn widen(src: &str, out: *mut u32) -> usize {
+    let src = src.as_bytes();
+    let (mut i, mut n) = (0, 0);
+    while i < src.len() {
+        if i + BLOCK <= src.len() && unsafe { widen_block(src.as_ptr().add(i), out.add(n)) } {
+            i += BLOCK;
+            n += BLOCK;
+            continue;
+        }
+        // One character; the input is known to be valid.
+        let b0 = src[i] as u32;
+        let (c, len) = if b0 < 0x80 {
+            (b0, 1)
+        } else if b0 < 0xe0 {
+            ((b0 & 0x1f) << 6 | (src[i + 1] as u32 & 0x3f), 2)
+        } else if b0 < 0xf0 {
+            ((b0 & 0x0f) << 12 | (src[i + 1] as u32 & 0x3f) << 6 | (src[i + 2] as u32 & 0x3f), 3)
+        } else {
+            ((b0 & 0x07) << 18 | (src[i + 1] as u32 & 0x3f) << 12 |
+             (src[i + 2] as u32 & 0x3f) << 6 | (src[i + 3] as u32 & 0x3f), 4)
+        };
+        unsafe {
+            *out.add(n) = c;
+        }
+        i += len;
+        n += 1;
+    }
+    n
+}
+
+// Encodes checked scalars as UTF-8 into `out`, which must have room for
+// all of them.
+fn narrow(src: &[u32], out: *mut u8) {
+    let (mut i, mut n) = (0, 0);
+    while i < src.len() {
+        if i + BLOCK <= src.len() && unsafe { narrow_block(src.as_ptr().add(i), out.add(n)) } {
+            i += BLOCK;
+            n += BLOCK;
+            continue;
+        }
+        // Checked by `utf8_len`.
+        let c = char::from_u32(src[i]).unwrap_or('\u{fffd}');
+        let dst = unsafe {
+            slice::from_raw_parts_mut(out.add(n), c.len_utf8())
+        };
+        n += c.encode_utf8(dst).len();
+        i += 1;
+    }
+}
+
+// The UTF-8 length of some scalars, checking that each is a Unicode scalar
+// value (at most U+10FFFF, and not a surrogate).
+fn utf8_len(src: &[u32]) -> Result<usize> {
+    let mut len = 0;
+    for c in src {
+        len += match *c {
+            0..=0x7f => 1,
+            0x80..=0x7ff => 2,
+            0xd800..=0xdfff => return Err(wit_err!(InvalidArgument, "Invalid argument; not a Unicode scalar value")),
+            0x800..=0xffff => 3,
+            0x1_0000..=0x10_ffff => 4,
+            _ => return Err(wit_err!(InvalidArgument, "Invalid argument; not a Unicode scalar value")),
+        };
+    }
+    Ok(len)
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Checks that `len` bytes are valid UTF-8, without converting them.
+#[no_mangle]
+pub extern "C" fn wit_utf8_validate(s: *mut WITSession, src: *const u8, len: usize) -> bool {
+    ffi_return!(s, _wit_utf8_validate(src, len))
+}
+fn _wit_utf8_validate(src: *const u8, len: usize) -> Result<()> {
+    if src.is_null() {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let src = unsafe {
+        slice::from_raw_parts(src, len)
+    };
+    str::from_utf8(src)?;
+    Ok(())
+}
+
+// Converts `len` bytes of UTF-8 to the elements of a `list<char>`.  The
+// scalars are copied into `out`, which holds `cap` of them, and `count` is
+// set to how many there are; if that's more than `cap`, nothing is copied.
+// A `cap` of at least `len` always fits, and saves counting first.
+#[no_mangle]
+pub extern "C" fn wit_utf8_to_chars(s: *mut WITSession, src: *const u8, len: usize, out: *mut u32, cap: usize, count: *mut usize) -> bool {
+    ffi_return!(s, _wit_utf8_to_chars(src, len, out, cap, count))
+}
+fn _wit_utf8_to_chars(src: *const u8, len: usize, out: *mut u32, cap: usize, count: *mut usize) -> Result<()> {
+    if src.is_null() || count.is_null() || (out.is_null() && cap > 0) {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let src = unsafe {
+        slice::from_raw_parts(src, len)
+    };
+    let src = str::from_utf8(src)?;
+    let n = if cap >= src.len() {
+        widen(src, out)
+    } else {
+        let n = src.chars().count();
+        if n <= cap {
+            widen(src, out);
+        }
+        n
+    };
+    unsafe {
+        *count = n;
+    }
+    Ok(())
+}
+
+// Converts the `count` elements of a `list<char>` to UTF-8.  The bytes are
+// copied into `out`, which holds `cap` of them, and `len` is set to how
+// many there are; if that's more than `cap`, nothing is copied.
+#[no_mangle]
+pub extern "C" fn wit_chars_to_utf8(s: *mut WITSession, src: *const u32, count: usize, out: *mut u8, cap: usize, len: *mut usize) -> bool {
+    ffi_return!(s, _wit_chars_to_utf8(src, count, out, cap, len))
+}
+fn _wit_chars_to_utf8(src: *const u32, count: usize, out: *mut u8, cap: usize, len: *mut usize) -> Result<()> {
+    if src.is_null() || len.is_null() || (out.is_null() && cap > 0) {
+        return Err(wit_err!(InvalidArgument, "Invalid arguments"))
+    }
+    let src = unsafe {
+        slice::from_raw_parts(src, count)
+    };
+    let n = utf8_len(src)?;
+    if n <= cap {
+        narrow(src, out);
+    }
+    unsafe {
+        *len = n;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::error::WITErrorCode;
+
+    // ASCII strings of every length up to a few blocks, and each of them
+    // with a wider character at every position, so the blocks straddle
+    // the character in every possible way.
+    fn samples() -> Vec<String> {
+        let mut out = Vec::new();
+        for len in 0..3 * BLOCK + 2 {
+            let ascii: String = (0..len).map(|i| (b'a' + (i % 26) as u8) as char).collect();
+            out.push(ascii.clone());
+            for at in 0..=len {
+                for c in ['\u{80}', 'é', 'Ā', '€', '😀'] {
+                    let mut s = ascii.clone();
+                    s.insert(at, c);
+                    out.push(s);
+                }
+            }
+        }
+        out
+    }
+
+    #[test]
+    fn widen_matches_chars() {
+        for s in samples() {
+            let mut out = vec![0u32; s.len()];
+            let n = widen(&s, out.as_mut_ptr());
+            let want: Vec<u32> = s.chars().map(|c| c as u32).collect();
+            assert_eq!(&out[..n], &want[..], "{:?}", s);
+        }
+    }
+
+    #[test]
+    fn narrow_matches_encode_utf8() {
+        for s in samples() {
+            let chars: Vec<u32> = s.chars().map(|c| c as u32).collect();
+            assert_eq!(utf8_len(&chars).unwrap(), s.len());
+            let mut out = vec![0u8; s.len()];
+            narrow(&chars, out.as_mut_ptr());
+            assert_eq!(out, s.as_bytes(), "{:?}", s);
+        }
+    }
+
+    #[test]
+    fn non_scalars_are_rejected() {
+        for c in [0xd800, 0xdfff, 0x11_0000, u32::MAX] {
+            let chars = [b'a' as u32; BLOCK].iter().copied().chain([c]).collect::<Vec<_>>();
+            assert_eq!(utf8_len(&chars).err().map(|e| e.code()), Some(WITErrorCode::InvalidArgument));
+        }
+    }
+
+    #[test]
+    fn short_output_is_counted_not_written() {
+        let s = "a€b😀";
+        let mut out = [0u32; 4];
+        let mut count = 0;
+        _wit_utf8_to_chars(s.as_ptr(), s.len(), out.as_mut_ptr(), 3, &mut count).unwrap();
+        assert_eq!(count, 4);
+        assert_eq!(out, [0; 4]);
+        _wit_utf8_to_chars(s.as_ptr(), s.len(), out.as_mut_ptr(), 4, &mut count).unwrap();
+        assert_eq!(count, 4);
+        assert_eq!(out, ['a' as u32, '€' as u32, 'b' as u32, '😀' as u32]);
+    }
+}